@@ -0,0 +1,438 @@
+#!/bin/bash
+
+TIMEFORMAT="%R"
+
+# Generates a source file with $1 small functions.
+gen_funcs() {
+    for i in $(seq 1 "$1"); do
+        echo "int f$i(int a, int b) { /* f$i */ int c = a * $i + b; return c; }"
+    done
+    echo "int main() { return f1(1, 2); }"
+}
+
+bench_threads() {
+    gen_funcs 100000 > tmp_bench.c
+    echo "tokenize $(wc -c < tmp_bench.c) bytes"
+    for n in 1 2 4 8; do
+        t=$( { time ./mdcc -fthreads=$n -f tmp_bench.c > /dev/null; } 2>&1 )
+        echo "  threads=$n: ${t}s"
+    done
+}
+
+# Generates a function with $1 nested blocks, each of which declares a
+# variable and refers to variables of the outermost blocks.
+gen_nested() {
+    echo "int main() { int v0 = 0;"
+    for i in $(seq 1 "$1"); do
+        echo "{ int v$i = v0 + $((i - 1)); v0 = v$i + v0;"
+    done
+    for i in $(seq 1 "$1"); do
+        echo "}"
+    done
+    echo "return v0; }"
+}
+
+bench_nesting() {
+    echo "nesting depth"
+    for n in 100 1000 4000; do
+        gen_nested $n > tmp_bench.c
+        t=$( { time ./mdcc -f tmp_bench.c > /dev/null; } 2>&1 )
+        echo "  depth=$n: ${t}s"
+    done
+}
+
+# Compiles tmp_bench.c with the given flags and times the program.
+run_compiled() {
+    ./mdcc "$@" -f tmp_bench.c > tmp_bench.s
+    gcc -arch x86_64 -o tmp_bench tmp_bench.s
+    { time ./tmp_bench; } 2>&1
+}
+
+bench_inline() {
+    cat > tmp_bench.c <<'END'
+int sq(int a) { return a * a; }
+int clamp(int a) { if (a > 100) return 100; return a; }
+int run(int n) {
+    int s = 0;
+    int i;
+    for (i = 0; i < n; i++) { s = s + clamp(sq(i) & 255); }
+    return s;
+}
+int main() {
+    int s = 0;
+    int j;
+    for (j = 0; j < 500; j++) { s = s + run(100000); }
+    return s & 127;
+}
+END
+    echo "inlining"
+    echo "  -fno-inline: $(run_compiled -fno-inline)s"
+    echo "  default: $(run_compiled)s"
+}
+
+bench_loops() {
+    cat > tmp_bench.c <<'END'
+int main() {
+    int a[1000];
+    int b[1000];
+    int i;
+    int j;
+    int n = 1000;
+    int k = 3;
+    for (i = 0; i < n; i++) { a[i] = i; b[i] = 0; }
+    for (j = 0; j < 20000; j++) {
+        for (i = 0; i < n; i++) { b[i] = b[i] + a[i] * k + n * k; }
+    }
+    return b[7] & 127;
+}
+END
+    echo "loops"
+    echo "  -fno-loop-opt: $(run_compiled -fno-loop-opt)s"
+    echo "  default: $(run_compiled)s"
+}
+
+bench_unroll() {
+    cat > tmp_bench.c <<'END'
+int main() {
+    int a[1000];
+    int i;
+    int j;
+    int s = 0;
+    for (i = 0; i < 1000; i++) { a[i] = i; }
+    for (j = 0; j < 30000; j++) {
+        for (i = 0; i < 1000; i++) { s = s + a[i]; }
+    }
+    return s & 127;
+}
+END
+    echo "counted loops"
+    for k in 1 2 4 8; do
+        echo "  -funroll=$k: $(run_compiled -funroll=$k)s"
+    done
+}
+
+bench_regalloc() {
+    cat > tmp_bench.c <<'END'
+int fib(int n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }
+int main() {
+    int i;
+    int s = 0;
+    int k = 7;
+    for (i = 0; i < 100000000; i++) { if (k == 7) { s = s + i; } else { s = s - i; } }
+    return (s + fib(32)) & 127;
+}
+END
+    echo "constants and registers"
+    echo "  -fno-regalloc: $(run_compiled -fno-regalloc)s"
+    echo "  default: $(run_compiled)s"
+}
+
+bench_cse() {
+    cat > tmp_bench.c <<'END'
+int main() {
+    int a[1000];
+    int b[1000];
+    int i;
+    int j;
+    int s = 0;
+    for (i = 0; i < 1000; i++) { a[i] = 0; b[i] = i; }
+    for (j = 0; j < 20000; j++) {
+        for (i = 0; i < 1000; i++) {
+            int x = b[i];
+            a[(x * x + j) & 1023 & 511] += x;
+            s = s + ((x * x + j) & 1023 & 511);
+        }
+    }
+    return (s + a[5]) & 127;
+}
+END
+    echo "common subexpressions"
+    echo "  -fno-cse: $(run_compiled -fno-cse)s"
+    echo "  default: $(run_compiled)s"
+}
+
+bench_arrays() {
+    cat > tmp_bench.c <<'END'
+int main() {
+    int a[1000];
+    int b[1000];
+    int i;
+    int j;
+    int s = 0;
+    for (i = 0; i < 1000; i++) { a[i] = i; b[i] = 1000 - i; }
+    for (j = 0; j < 30000; j++) {
+        for (i = 1; i < 999; i++) { s = s + a[i - 1] * b[i + 1] + a[i]; }
+    }
+    return s & 127;
+}
+END
+    echo "array subscripts"
+    echo "  default: $(run_compiled)s, $(wc -l < tmp_bench.s) lines of assembly"
+}
+
+# A Brainf*ck interpreter running ++++[>-[>-[>-[-]<-]<-]<-].
+bench_bf() {
+    cat > tmp_bench.c <<'END'
+int main() {
+    char prog[] = {43, 43, 43, 43, 91, 62, 45, 91, 62, 45, 91, 62, 45, 91, 45, 93,
+                   60, 45, 93, 60, 45, 93, 60, 45, 93, 0};
+    char tape[100];
+    int jump[32];
+    int stack[32];
+    int sp = 0;
+    int i;
+    for (i = 0; i < 100; i++) { tape[i] = 0; }
+    for (i = 0; prog[i] != 0; i++) {
+        if (prog[i] == 91) { stack[sp] = i; sp++; }
+        if (prog[i] == 93) { sp--; jump[i] = stack[sp]; jump[stack[sp]] = i; }
+    }
+    int pc = 0;
+    int p = 0;
+    while (prog[pc] != 0) {
+        char c = prog[pc];
+        if (c == 43) { tape[p] = tape[p] + 1; }
+        else { if (c == 45) { tape[p] = tape[p] - 1; }
+        else { if (c == 62) { p++; }
+        else { if (c == 60) { p--; }
+        else { if (c == 91) { if (tape[p] == 0) { pc = jump[pc]; } }
+        else { if (tape[p] != 0) { pc = jump[pc]; } } } } } }
+        pc++;
+    }
+    return tape[0] + tape[1] + tape[2];
+}
+END
+    echo "char loops (Brainf*ck)"
+    echo "  default: $(run_compiled)s"
+}
+
+# Generates a loop dividing by $1 and taking the remainder by $2, where p
+# and q are 7 and 10 unknown at compile time.
+gen_div() {
+    cat <<END
+int main() {
+    int d[2];
+    d[0] = 7;
+    d[1] = 10;
+    int p = d[0];
+    int q = d[1];
+    int i;
+    int s = 0;
+    for (i = 0 - 50000000; i < 50000000; i++) { s = s / $1 + i % $2 + i; }
+    return s & 127;
+}
+END
+}
+
+bench_div() {
+    echo "division"
+    gen_div p q > tmp_bench.c
+    echo "  variable divisors (idiv): $(run_compiled)s"
+    gen_div 7 10 > tmp_bench.c
+    echo "  constant divisors: $(run_compiled)s"
+}
+
+bench_calls() {
+    cat > tmp_bench.c <<'END'
+int fib(int n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }
+int add3(int a, int b, int c) { return a + b + c; }
+int main() {
+    int i;
+    int s = 0;
+    for (i = 0; i < 30000000; i++) { s = add3(s, i, 1) & 1023; }
+    return (s + fib(32)) & 127;
+}
+END
+    echo "calls"
+    echo "  -fno-inline -fno-omit-frame-pointer: $(run_compiled -fno-inline -fno-omit-frame-pointer)s"
+    echo "  -fno-inline: $(run_compiled -fno-inline)s"
+}
+
+bench_tail_calls() {
+    cat > tmp_bench.c <<'END'
+int count(int n, int acc) { if (n == 0) return acc; return count(n - 1, acc + (n & 3)); }
+int main() {
+    int s = 0;
+    int j;
+    for (j = 0; j < 1000; j++) { s = s + count(100000, j); }
+    return s & 127;
+}
+END
+    echo "tail calls"
+    echo "  -fno-tail-calls: $(run_compiled)s"
+    echo "  default: $(run_compiled)s"
+}
+
+# Generates a bytecode interpreter whose eight opcodes are $1 to $8. The
+# program is a random sequence of them.
+gen_dispatch() {
+    cat <<END
+int main() {
+    int ops[8];
+    int code[256];
+    ops[0] = $1; ops[1] = $2; ops[2] = $3; ops[3] = $4;
+    ops[4] = $5; ops[5] = $6; ops[6] = $7; ops[7] = $8;
+    int seed = 1;
+    int i;
+    for (i = 0; i < 256; i++) { seed = seed * 1103515245 + 12345; code[i] = ops[(seed >> 16) & 7]; }
+    int acc = 0;
+    int x = 1;
+    for (i = 0; i < 100000000; i++) {
+        switch (code[i & 255]) {
+        case $1: acc = acc + 1; break;
+        case $2: acc = acc ^ 5; break;
+        case $3: acc = acc * 3; break;
+        case $4: acc = acc & 1048575; break;
+        case $5: acc = acc + x; break;
+        case $6: x = acc & 255; break;
+        case $7: acc = acc - 7; break;
+        case $8: x = x + 1; break;
+        }
+    }
+    return (acc + x) & 127;
+}
+END
+}
+
+bench_switch() {
+    echo "switch dispatch"
+    gen_dispatch 0 1 2 3 4 5 6 7 > tmp_bench.c
+    echo "  dense, -fno-jump-tables: $(run_compiled -fno-jump-tables)s"
+    echo "  dense (jump table): $(run_compiled)s"
+    gen_dispatch 1 9 30 77 150 400 1000 4000 > tmp_bench.c
+    echo "  sparse (binary search): $(run_compiled)s"
+}
+
+# Generates a function that sets up a table of 64 ints and a buffer of 256
+# ints, mostly zero, on every call.
+gen_tables() {
+    cat <<END
+int lookup(int i) {
+    int t[64] = {$(seq -s ', ' 7 7 448)};
+    int seen[256] = {1};
+    seen[i & 255] = t[i & 63];
+    return seen[(i * 7) & 255] + t[(i >> 2) & 63];
+}
+int main() {
+    int s = 0;
+    int i;
+    for (i = 0; i < 10000000; i++) { s = s + lookup(i); }
+    return s & 127;
+}
+END
+}
+
+bench_inits() {
+    gen_tables > tmp_bench.c
+    echo "array initializers"
+    echo "  default: $(run_compiled)s"
+}
+
+# Generates a lookup in a table of 64 ints declared by $1 at file scope and
+# by $2 in the function.
+gen_lookup() {
+    cat <<END
+$1
+int lookup(int i) {
+    $2
+    return t[i & 63] + t[(i * 7) & 63];
+}
+int main() {
+    int s = 0;
+    int i;
+    for (i = 0; i < 30000000; i++) { s = s + lookup(i); }
+    return s & 127;
+}
+END
+}
+
+bench_globals() {
+    local table="int t[64] = {$(seq -s ', ' 7 7 448)};"
+    echo "lookup tables"
+    gen_lookup "" "$table" > tmp_bench.c
+    echo "  local: $(run_compiled)s"
+    gen_lookup "$table" "" > tmp_bench.c
+    echo "  global: $(run_compiled)s"
+}
+
+# Sums the sizes of the variables in the frames of the programs in test.sh
+# compiled with the given flags.
+frame_bytes() {
+    sed -n 's/^test_ [0-9]* "\(.*\)"$/\1/p' test.sh | while read -r prog; do
+        ./mdcc -fframe-report "$@" -e "$prog" 2>&1 > /dev/null
+    done | awk '{ s += $2 } END { print s }'
+}
+
+bench_frames() {
+    cat > tmp_bench.c <<'END'
+int walk(int n) {
+    int s = 0;
+    int i;
+    { int a[256]; for (i = 0; i < 256; i++) { a[i] = i + n; } s = s + a[n & 255]; }
+    { int b[256]; for (i = 0; i < 256; i++) { b[i] = i * n; } s = s + b[n & 255]; }
+    { int c[256]; for (i = 0; i < 256; i++) { c[i] = i ^ n; } s = s + c[n & 255]; }
+    { int d[256]; for (i = 0; i < 256; i++) { d[i] = i | n; } s = s + d[n & 255]; }
+    if (n == 0) { return s; }
+    return (s + walk(n - 1)) & 65535;
+}
+int main() {
+    int s = 0;
+    int j;
+    for (j = 0; j < 600; j++) { s = s + walk(1000); }
+    return s & 127;
+}
+END
+    echo "stack frames"
+    echo "  test corpus: $(frame_bytes) bytes of variables, $(frame_bytes -fno-stack-coloring) with -fno-stack-coloring"
+    echo "  -fno-stack-coloring: $(run_compiled -fno-stack-coloring)s"
+    echo "  default: $(run_compiled)s"
+}
+
+bench_vectorize() {
+    cat > tmp_bench.c <<'END'
+int add(int *c, int *a, int *b, int n) {
+    int i;
+    for (i = 0; i < n; i++) { c[i] = a[i] + b[i]; }
+    return 0;
+}
+int mask(char *d, char *s, int n, int k) {
+    int i;
+    for (i = 0; i < n; i++) { d[i] = (s[i] ^ k) & 95; }
+    return 0;
+}
+int main() {
+    int a[4000];
+    int b[4000];
+    int c[4000];
+    char s[4000];
+    char d[4000];
+    int i;
+    int j;
+    for (i = 0; i < 4000; i++) { a[i] = i; b[i] = 7 * i; s[i] = i; }
+    for (j = 0; j < 100000; j++) { add(c, a, b, 4000); mask(d, s, 4000, j); }
+    return (c[3999] + d[17]) & 127;
+}
+END
+    echo "vectorized loops"
+    echo "  -fno-vectorize: $(run_compiled -fno-vectorize)s"
+    echo "  default: $(run_compiled)s"
+}
+
+bench_threads
+bench_nesting
+bench_inline
+bench_loops
+bench_unroll
+bench_regalloc
+bench_cse
+bench_arrays
+bench_bf
+bench_div
+bench_calls
+bench_tail_calls
+bench_switch
+bench_inits
+bench_globals
+bench_frames
+bench_vectorize
+
+rm -f tmp_bench tmp_bench.c tmp_bench.s
@@ -0,0 +1,288 @@
+#include "mdcc.h"
+
+// Leaf functions with at most this many nodes are placed together.
+#define TINY_FUNC_SIZE 24
+
+typedef struct CGNode {
+  Node *func;
+  Vector *edges; // calls to other functions in the program
+  int size;      // number of nodes
+  bool leaf;     // calls no function at all
+  bool noreturn; // always ends by calling a function that does not return
+  bool reached;  // reachable from the roots
+  bool cold;     // only called from error paths
+  bool placed;
+} CGNode;
+
+typedef struct {
+  CGNode *from;
+  CGNode *to;
+  int hot;  // number of call sites outside error paths
+  int cold; // number of call sites in error paths
+} Edge;
+
+static Map *nodes;  // function name -> CGNode
+static Vector *all; // CGNodes in the source order
+
+static bool noreturn_call(Node *node) {
+  if (node->ty != ND_CALL)
+    return false;
+  if (!strcmp(node->name, "exit") || !strcmp(node->name, "abort"))
+    return true;
+  CGNode *n = map_get(nodes, node->name);
+  return n && n->noreturn;
+}
+
+// Returns true if control may leave the statement other than by falling
+// through, or reach it from elsewhere, as a case label does.
+static bool may_leave(Node *node) {
+  if (node == NULL)
+    return false;
+  switch (node->ty) {
+  case ND_RETURN:
+  case ND_BREAK:
+  case ND_CASE:
+    return true;
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      if (may_leave(node->stmts->data[i]))
+        return true;
+    return false;
+  case ND_IF:
+    return may_leave(node->then) || may_leave(node->els);
+  case ND_FOR:
+  case ND_WHILE:
+  case ND_SWITCH:
+    return may_leave(node->body);
+  }
+  return false;
+}
+
+// An error path is a statement that always ends by calling a function that
+// never returns, such as exit(). The call must be reached on every path
+// through it.
+static bool is_error_path(Node *node) {
+  if (node == NULL)
+    return false;
+  switch (node->ty) {
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++) {
+      Node *stmt = node->stmts->data[i];
+      if (is_error_path(stmt))
+        return true;
+      if (may_leave(stmt))
+        return false;
+    }
+    return false;
+  case ND_IF:
+    return is_error_path(node->then) && is_error_path(node->els);
+  }
+  return noreturn_call(node);
+}
+
+static void add_call(CGNode *from, Node *call, bool cold) {
+  from->leaf = false;
+  CGNode *to = map_get(nodes, call->name);
+  if (to == NULL)
+    return;
+
+  Edge *e = NULL;
+  for (int i = 0; i < from->edges->len; i++) {
+    Edge *e2 = from->edges->data[i];
+    if (e2->to == to)
+      e = e2;
+  }
+  if (e == NULL) {
+    e = alloc(sizeof(Edge));
+    e->from = from;
+    e->to = to;
+    vec_push(from->edges, e);
+  }
+  if (cold)
+    e->cold++;
+  else
+    e->hot++;
+}
+
+static void scan(CGNode *from, Node *node, bool cold) {
+  if (node == NULL)
+    return;
+  from->size++;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return;
+  case ND_CALL:
+    add_call(from, node, cold);
+    for (int i = 0; i < node->args->len; i++)
+      scan(from, node->args->data[i], cold);
+    return;
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      scan(from, node->stmts->data[i], cold);
+    return;
+  case ND_INITS:
+    for (int i = 0; i < node->inits->len; i++)
+      scan(from, node->inits->data[i], cold);
+    return;
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_INC:
+  case ND_DEC:
+    scan(from, node->expr, cold);
+    return;
+  case ND_IF:
+    scan(from, node->cond, cold);
+    scan(from, node->then, cold || is_error_path(node->then));
+    scan(from, node->els, cold || is_error_path(node->els));
+    return;
+  case ND_FOR:
+  case ND_VECTOR:
+    scan(from, node->init, cold);
+    scan(from, node->cond, cold);
+    scan(from, node->after, cold);
+    scan(from, node->body, cold);
+    return;
+  case ND_WHILE:
+  case ND_SWITCH:
+    scan(from, node->cond, cold);
+    scan(from, node->body, cold);
+    return;
+  case ND_INLINE:
+    scan(from, node->body, cold);
+    return;
+  default:
+    scan(from, node->lhs, cold);
+    scan(from, node->rhs, cold);
+  }
+}
+
+static void reach(CGNode *n) {
+  if (n->reached)
+    return;
+  n->reached = true;
+  for (int i = 0; i < n->edges->len; i++)
+    reach(((Edge *)n->edges->data[i])->to);
+}
+
+// A function is cold if no reachable function that is not cold calls it
+// outside of an error path. Without main, nothing is known to be cold.
+static void mark_cold(CGNode *root) {
+  for (int i = 0; i < all->len; i++) {
+    CGNode *n = all->data[i];
+    n->cold = root && n->reached && n != root;
+  }
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < all->len; i++) {
+      CGNode *from = all->data[i];
+      if (!from->reached || from->cold)
+        continue;
+      for (int j = 0; j < from->edges->len; j++) {
+        Edge *e = from->edges->data[j];
+        if (e->hot > 0 && e->to->cold) {
+          e->to->cold = false;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+static int cmp_edge(const void *a, const void *b) {
+  Edge *x = *(Edge **)a;
+  Edge *y = *(Edge **)b;
+  return (y->hot + y->cold) - (x->hot + x->cold);
+}
+
+// Places callees right after their callers, visiting the most frequently
+// called ones first. Tiny leaf functions and cold functions are collected
+// into their own groups.
+static void place(CGNode *n, Vector *hot, Vector *tiny, Vector *cold) {
+  if (n->placed)
+    return;
+  n->placed = true;
+  if (n->cold)
+    vec_push(cold, n->func);
+  else if (n->leaf && n->size <= TINY_FUNC_SIZE)
+    vec_push(tiny, n->func);
+  else
+    vec_push(hot, n->func);
+
+  qsort(n->edges->data, n->edges->len, sizeof(void *), cmp_edge);
+  for (int i = 0; i < n->edges->len; i++)
+    place(((Edge *)n->edges->data[i])->to, hot, tiny, cold);
+}
+
+/**
+ * Removes functions that are not reachable from main and orders the rest so
+ * that callers are close to their callees. Tiny leaf functions are grouped
+ * after them, and functions only called from error paths come last with
+ * their cold flag set.
+ */
+Node *callgraph(Node *node) {
+  nodes = new_map();
+  all = new_vec();
+  for (int i = 0; i < node->funcs->len; i++) {
+    Node *func = node->funcs->data[i];
+    CGNode *n = alloc(sizeof(CGNode));
+    n->func = func;
+    n->edges = new_vec();
+    map_set(nodes, func->name, n);
+    vec_push(all, n);
+  }
+
+  // Find the functions that always end in a noreturn call.
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < all->len; i++) {
+      CGNode *n = all->data[i];
+      if (!n->noreturn && is_error_path(n->func->body)) {
+        n->noreturn = true;
+        changed = true;
+      }
+    }
+  }
+
+  for (int i = 0; i < all->len; i++) {
+    CGNode *n = all->data[i];
+    n->leaf = true;
+    scan(n, n->func->body, false);
+  }
+
+  // Only main is global. Without it, every function is a root.
+  CGNode *root = map_get(nodes, "main");
+  if (root)
+    reach(root);
+  else
+    for (int i = 0; i < all->len; i++)
+      reach(all->data[i]);
+  mark_cold(root);
+
+  Vector *hot = new_vec();
+  Vector *tiny = new_vec();
+  Vector *cold = new_vec();
+  if (root)
+    place(root, hot, tiny, cold);
+  for (int i = 0; i < all->len; i++) {
+    CGNode *n = all->data[i];
+    if (n->reached)
+      place(n, hot, tiny, cold);
+  }
+
+  node->funcs = new_vec();
+  for (int i = 0; i < hot->len; i++)
+    vec_push(node->funcs, hot->data[i]);
+  for (int i = 0; i < tiny->len; i++)
+    vec_push(node->funcs, tiny->data[i]);
+  for (int i = 0; i < cold->len; i++) {
+    Node *func = cold->data[i];
+    func->cold = true;
+    vec_push(node->funcs, func);
+  }
+  return node;
+}
@@ -0,0 +1,402 @@
+#include "mdcc.h"
+
+static Node *func;
+
+// False after a return, until control flow joins a reachable path.
+static bool reachable;
+
+// Known values of the variables of the function, saved at branches.
+typedef struct {
+  bool *is_const;
+  int *vals;
+  bool reachable;
+} State;
+
+static State *save() {
+  Vector *vars = func->func_vars;
+  State *s = alloc(sizeof(State));
+  s->is_const = alloc(sizeof(bool) * (vars->len + 1));
+  s->vals = alloc(sizeof(int) * (vars->len + 1));
+  for (int i = 0; i < vars->len; i++) {
+    Var *var = vars->data[i];
+    s->is_const[i] = var->is_const;
+    s->vals[i] = var->const_val;
+  }
+  s->reachable = reachable;
+  return s;
+}
+
+static void restore(State *s) {
+  Vector *vars = func->func_vars;
+  for (int i = 0; i < vars->len; i++) {
+    Var *var = vars->data[i];
+    var->is_const = s->is_const[i];
+    var->const_val = s->vals[i];
+  }
+  reachable = s->reachable;
+}
+
+// Joins the current state with s, which reaches the same point.
+static void merge(State *s) {
+  if (!s->reachable)
+    return;
+  if (!reachable) {
+    restore(s);
+    return;
+  }
+  Vector *vars = func->func_vars;
+  for (int i = 0; i < vars->len; i++) {
+    Var *var = vars->data[i];
+    if (!s->is_const[i] || s->vals[i] != var->const_val)
+      var->is_const = false;
+  }
+}
+
+static void kill_assigned(Node *node);
+
+static void kill_all(Vector *nodes) {
+  for (int i = 0; i < nodes->len; i++)
+    kill_assigned(nodes->data[i]);
+}
+
+// Forgets the values of the variables assigned in node.
+static void kill_assigned(Node *node) {
+  if (node == NULL)
+    return;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return;
+  case ND_CALL:
+    kill_all(node->args);
+    return;
+  case ND_COMP_STMT:
+    kill_all(node->stmts);
+    return;
+  case ND_INITS:
+    kill_all(node->inits);
+    return;
+  case ND_INC:
+  case ND_DEC:
+    if (node->expr->ty == ND_IDENT)
+      node->expr->var->is_const = false;
+    // fallthrough
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+    kill_assigned(node->expr);
+    return;
+  case ND_IF:
+    kill_assigned(node->cond);
+    kill_assigned(node->then);
+    kill_assigned(node->els);
+    return;
+  case ND_FOR:
+    kill_assigned(node->init);
+    kill_assigned(node->cond);
+    kill_assigned(node->after);
+    kill_assigned(node->body);
+    return;
+  case ND_WHILE:
+  case ND_SWITCH:
+  case ND_INLINE:
+    kill_assigned(node->cond);
+    kill_assigned(node->body);
+    return;
+  case '=':
+    if (node->lhs->ty == ND_IDENT)
+      node->lhs->var->is_const = false;
+    // fallthrough
+  default:
+    kill_assigned(node->lhs);
+    kill_assigned(node->rhs);
+  }
+}
+
+// Pointers are not folded, so their values are not followed.
+static bool is_const_var(Var *var) {
+  return is_tracked(var) && var->ty->ty != TY_PTR;
+}
+
+// Returns the value a variable of the type holds after storing val. Chars
+// are signed.
+static long wrap(long val, Type *ty) {
+  if (ty->size == 1)
+    return (signed char)val;
+  if (ty->size == 4)
+    return (int)val;
+  return val;
+}
+
+static Node *new_num(long val, Type *ty) {
+  Node *node = new_node_num(val);
+  node->cty = ty;
+  return node;
+}
+
+// Folds a binary operator on constants. Returns NULL if the result is not
+// known or does not fit in a node.
+static Node *fold(Node *node) {
+  if (node->lhs->ty != ND_NUM || node->rhs->ty != ND_NUM ||
+      node->cty->ty == TY_PTR || node->cty->ty == TY_ARR)
+    return NULL;
+  long l = node->lhs->val;
+  long r = node->rhs->val;
+  unsigned long ul = l;
+  unsigned long ur = r;
+  long val;
+  switch (node->ty) {
+  case '+':
+    val = ul + ur;
+    break;
+  case '-':
+    val = ul - ur;
+    break;
+  case '*':
+    val = ul * ur;
+    break;
+  case '/':
+  case '%':
+    // Rounds toward zero like idiv. Division by zero and INT_MIN / -1 trap
+    // at run time instead.
+    if (r == 0 || (r == -1 && l == INT_MIN))
+      return NULL;
+    val = node->ty == '/' ? l / r : l % r;
+    break;
+  case '&':
+    val = l & r;
+    break;
+  case '|':
+    val = l | r;
+    break;
+  case '^':
+    val = l ^ r;
+    break;
+  case ND_SHL:
+    if (r < 0 || r >= node->cty->size * 8)
+      return NULL;
+    val = ul << r;
+    break;
+  case ND_SHR:
+    if (l < 0 || r < 0 || r >= node->cty->size * 8)
+      return NULL;
+    val = l >> r;
+    break;
+  case ND_EQ:
+    return new_num(wrap(l, node->cty) == wrap(r, node->cty), new_int_ty());
+  case ND_NEQ:
+    return new_num(wrap(l, node->cty) != wrap(r, node->cty), new_int_ty());
+  case '<':
+    return new_num(wrap(l, node->cty) < wrap(r, node->cty), new_int_ty());
+  case '>':
+    return new_num(wrap(l, node->cty) > wrap(r, node->cty), new_int_ty());
+  case ND_AND:
+    return new_num(l && r, new_int_ty());
+  case ND_OR:
+    return new_num(l || r, new_int_ty());
+  default:
+    return NULL;
+  }
+  val = wrap(val, node->cty);
+  if (val < INT_MIN || val > INT_MAX)
+    return NULL;
+  return new_num(val, node->cty);
+}
+
+static Node *stmt(Node *node);
+
+// Propagates constants into an expression and folds it.
+static Node *expr(Node *node) {
+  if (node == NULL)
+    return NULL;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_NULL:
+    return node;
+  case ND_IDENT:
+    if (is_const_var(node->var) && node->var->is_const)
+      return new_num(node->var->const_val, node->var->ty);
+    return node;
+  case ND_CALL:
+    for (int i = 0; i < node->args->len; i++)
+      node->args->data[i] = expr(node->args->data[i]);
+    return node;
+  case ND_ADDR:
+    if (node->expr->ty == ND_DEREF)
+      node->expr->expr = expr(node->expr->expr);
+    return node;
+  case ND_DEREF:
+    node->expr = expr(node->expr);
+    return node;
+  case ND_INC:
+  case ND_DEC:
+    if (node->expr->ty == ND_DEREF) {
+      node->expr->expr = expr(node->expr->expr);
+    } else if (node->expr->var->is_const) {
+      Var *var = node->expr->var;
+      long val = (long)var->const_val + (node->ty == ND_INC ? 1 : -1);
+      val = wrap(val, var->ty);
+      // A long may leave the range of const_val.
+      var->is_const = val >= INT_MIN && val <= INT_MAX;
+      var->const_val = val;
+    }
+    return node;
+  case ND_INLINE: {
+    // Constants flow into the inlined body, but returns may leave it
+    // anywhere, so nothing assigned in it is known afterwards.
+    State *s = save();
+    node->body = stmt(node->body);
+    restore(s);
+    kill_assigned(node->body);
+    return node;
+  }
+  case ND_AND:
+  case ND_OR: {
+    // The rhs may not be evaluated.
+    node->lhs = expr(node->lhs);
+    State *s = save();
+    node->rhs = expr(node->rhs);
+    merge(s);
+    Node *folded = fold(node);
+    return folded ? folded : node;
+  }
+  case '=': {
+    if (node->lhs->ty == ND_DEREF)
+      node->lhs->expr = expr(node->lhs->expr);
+    node->rhs = expr(node->rhs);
+    if (node->lhs->ty != ND_IDENT)
+      return node;
+    Var *var = node->lhs->var;
+    var->is_const = is_const_var(var) && node->rhs->ty == ND_NUM;
+    if (var->is_const)
+      var->const_val = wrap(node->rhs->val, var->ty);
+    return node;
+  }
+  default: {
+    node->lhs = expr(node->lhs);
+    node->rhs = expr(node->rhs);
+    Node *folded = fold(node);
+    return folded ? folded : node;
+  }
+  }
+}
+
+// Processes a loop whose condition is tested before each iteration.
+static void loop(Node *node) {
+  // Only the values of the variables not assigned in the loop are known in
+  // every iteration.
+  State *entry = save();
+  Node *cond = expr(copy_node(node->cond, NULL, NULL));
+  restore(entry);
+  if (cond && cond->ty == ND_NUM && cond->val == 0) {
+    node->cond = cond;
+    return;
+  }
+
+  kill_assigned(node->cond);
+  kill_assigned(node->body);
+  if (node->ty == ND_FOR)
+    kill_assigned(node->after);
+  State *head = save();
+  node->cond = expr(node->cond);
+  node->body = stmt(node->body);
+  if (node->ty == ND_FOR)
+    node->after = stmt(node->after);
+  restore(head);
+}
+
+// State at the case labels of the switch being processed.
+static State *switch_head;
+
+static Node *stmt(Node *node) {
+  if (node == NULL)
+    return NULL;
+  switch (node->ty) {
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      node->stmts->data[i] = stmt(node->stmts->data[i]);
+    return node;
+  case ND_IF: {
+    node->cond = expr(node->cond);
+    if (node->cond->ty == ND_NUM) {
+      // The other branch is removed by dce.
+      if (node->cond->val)
+        node->then = stmt(node->then);
+      else
+        node->els = stmt(node->els);
+      return node;
+    }
+    State *s = save();
+    node->then = stmt(node->then);
+    State *then = save();
+    restore(s);
+    node->els = stmt(node->els);
+    merge(then);
+    return node;
+  }
+  case ND_FOR:
+    node->init = stmt(node->init);
+    loop(node);
+    return node;
+  case ND_WHILE:
+    loop(node);
+    return node;
+  case ND_SWITCH: {
+    // A case label is reached from the switch or by falling through, so
+    // only the values of the variables not assigned in the body are known
+    // there and after the switch.
+    node->cond = expr(node->cond);
+    kill_assigned(node->body);
+    State *outer = switch_head;
+    switch_head = save();
+    node->body = stmt(node->body);
+    restore(switch_head);
+    switch_head = outer;
+    return node;
+  }
+  case ND_CASE:
+    merge(switch_head);
+    return node;
+  case ND_BREAK:
+    reachable = false;
+    return node;
+  case ND_RETURN:
+    node->expr = expr(node->expr);
+    reachable = false;
+    return node;
+  case ND_INITS:
+    for (int i = 0; i < node->inits->len; i++)
+      node->inits->data[i] = expr(node->inits->data[i]);
+    return node;
+  default:
+    return expr(node);
+  }
+}
+
+static void const_prop_func(Node *node) {
+  func = node;
+  mark_escaped(func->body);
+  for (int i = 0; i < func->func_vars->len; i++)
+    ((Var *)func->func_vars->data[i])->is_const = false;
+  reachable = true;
+  func->body = stmt(func->body);
+}
+
+/**
+ * Replaces the variables whose values are known constants with the
+ * constants, and folds the operators on constants. Only branches that can
+ * run are followed, so an assignment in a branch that is never taken does
+ * not make a variable unknown. Takes either the root or a single function.
+ */
+Node *const_prop(Node *node) {
+  if (node->ty == ND_FUNC) {
+    const_prop_func(node);
+    return node;
+  }
+  for (int i = 0; i < node->funcs->len; i++)
+    const_prop_func(node->funcs->data[i]);
+  return node;
+}
@@ -11,15 +11,30 @@ static Node *arr_to_ptr(Node *node) {
 static Type *implicit_conv(Node *lhs, Node *rhs) {
   // When lhs or rhs is a number, use the type of another.
   // (e.g., a+2 => return type of a).
+  Type *ty;
   if (lhs->ty == ND_NUM)
-    return rhs->cty;
-  if (rhs->ty == ND_NUM)
-    return lhs->cty;
-
-  if (lhs->cty->size > rhs->cty->size)
-    return lhs->cty;
+    ty = rhs->cty;
+  else if (rhs->ty == ND_NUM)
+    ty = lhs->cty;
+  else if (lhs->cty->size > rhs->cty->size)
+    ty = lhs->cty;
   else
-    return rhs->cty;
+    ty = rhs->cty;
+
+  // Chars are promoted to int.
+  if (ty->size < 4)
+    return new_int_ty();
+  return ty;
+}
+
+// Scales an integer added to or subtracted from a pointer by the size of the
+// pointee.
+static Node *scale(Node *node, int size) {
+  if (size == 1)
+    return node;
+  Node *node2 = new_node('*', node, new_node_num(size));
+  node2->cty = new_long_ty();
+  return node2;
 }
 
 static Node *walk(Node *node) {
@@ -35,6 +50,8 @@ static Node *walk(Node *node) {
     }
     return node;
   case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
     return node;
   case ND_IDENT:
     return arr_to_ptr(node);
@@ -83,6 +100,7 @@ static Node *walk(Node *node) {
     node->body = walk(node->body);
     return node;
   case ND_WHILE:
+  case ND_SWITCH:
     node->cond = walk(node->cond);
     node->body = walk(node->body);
     return node;
@@ -95,11 +113,38 @@ static Node *walk(Node *node) {
     node->rhs = walk(node->rhs);
     node->cty = node->lhs->cty;
     return node;
+  case ND_OPASSIGN:
+    if (node->lhs->ty == ND_IDENT) {
+      // Reading a variable twice has no effect, and the optimizers
+      // recognize the plain assignment.
+      Node *rhs = new_node(node->op, node->lhs, node->rhs);
+      return walk(new_node('=', node->lhs, rhs));
+    }
+    node->lhs = walk(node->lhs);
+    node->rhs = walk(node->rhs);
+    if (node->lhs->cty->ty == TY_PTR && (node->op == '+' || node->op == '-'))
+      node->rhs = scale(node->rhs, node->lhs->cty->ptr_to->size);
+    node->cty = node->lhs->cty;
+    return node;
+  case '+':
+    node->lhs = walk(node->lhs);
+    node->rhs = walk(node->rhs);
+    if (node->rhs->cty->ty == TY_PTR) {
+      Node *tmp = node->lhs;
+      node->lhs = node->rhs;
+      node->rhs = tmp;
+    }
+    if (node->lhs->cty->ty == TY_PTR) {
+      node->rhs = scale(node->rhs, node->lhs->cty->ptr_to->size);
+      node->cty = node->lhs->cty;
+    } else {
+      node->cty = implicit_conv(node->lhs, node->rhs);
+    }
+    return node;
   case ND_EQ:
   case ND_NEQ:
   case '<':
   case '>':
-  case '+':
   case '*':
   case '/':
   case '%':
@@ -118,9 +163,7 @@ static Node *walk(Node *node) {
     node->lhs = walk(node->lhs);
     node->rhs = walk(node->rhs);
     if (node->lhs->cty->ty == TY_PTR) {
-      node->rhs =
-          new_node('*', node->rhs, new_node_num(node->lhs->cty->ptr_to->size));
-      node->rhs->cty = implicit_conv(node->rhs->lhs, node->rhs->rhs);
+      node->rhs = scale(node->rhs, node->lhs->cty->ptr_to->size);
       node->cty = node->lhs->cty;
     } else {
       node->cty = implicit_conv(node->lhs, node->rhs);
@@ -0,0 +1,298 @@
+#include "mdcc.h"
+
+static Node *func;
+
+/**
+ * A value computed in the current basic block. The first occurrence of the
+ * expression is at "site". When it occurs again, the first occurrence is
+ * replaced by an assignment to "tmp" and the others read tmp.
+ */
+typedef struct {
+  Node **site;
+  Var *tmp;
+} Value;
+
+// Key of an expression -> Value
+static Map *values;
+
+static bool is_pure_op(int ty) {
+  switch (ty) {
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+  case '%':
+  case '&':
+  case '|':
+  case '^':
+  case ND_SHL:
+  case ND_SHR:
+  case ND_EQ:
+  case ND_NEQ:
+  case '<':
+  case '>':
+    return true;
+  }
+  return false;
+}
+
+static bool is_leaf(Node *node) {
+  return node->ty == ND_NUM || node->ty == ND_IDENT;
+}
+
+// Worth keeping in a temporary instead of recomputing.
+static bool is_expensive(Node *node) {
+  if (node->ty == '*' || node->ty == '/' || node->ty == '%')
+    return true;
+  return !is_leaf(node->lhs) || !is_leaf(node->rhs);
+}
+
+/**
+ * Returns a key that is the same for expressions computing the same value
+ * in a basic block, or NULL if node reads memory or has side effects.
+ * Variables are keyed by the number of assignments to them so far.
+ */
+static char *key(Node *node) {
+  switch (node->ty) {
+  case ND_NUM:
+    return format("%d", node->val);
+  case ND_IDENT:
+    if (!is_tracked(node->var))
+      return NULL;
+    return format("v%p.%d", node->var, node->var->version);
+  }
+  if (!is_pure_op(node->ty))
+    return NULL;
+  char *lhs = key(node->lhs);
+  if (lhs == NULL)
+    return NULL;
+  char *rhs = key(node->rhs);
+  if (rhs == NULL)
+    return NULL;
+  return format("(%d %d %s %s)", node->ty, node->cty->size, lhs, rhs);
+}
+
+static void bump(Node *node);
+
+static void bump_all(Vector *nodes) {
+  for (int i = 0; i < nodes->len; i++)
+    bump(nodes->data[i]);
+}
+
+// Invalidates the values of the variables assigned in node, which is not
+// numbered.
+static void bump(Node *node) {
+  if (node == NULL)
+    return;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return;
+  case ND_CALL:
+    bump_all(node->args);
+    return;
+  case ND_COMP_STMT:
+    bump_all(node->stmts);
+    return;
+  case ND_INITS:
+    bump_all(node->inits);
+    return;
+  case ND_INC:
+  case ND_DEC:
+    if (node->expr->ty == ND_IDENT)
+      node->expr->var->version++;
+    // fallthrough
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+    bump(node->expr);
+    return;
+  case ND_IF:
+    bump(node->cond);
+    bump(node->then);
+    bump(node->els);
+    return;
+  case ND_FOR:
+  case ND_VECTOR:
+    bump(node->init);
+    bump(node->cond);
+    bump(node->after);
+    bump(node->body);
+    return;
+  case ND_WHILE:
+  case ND_SWITCH:
+  case ND_INLINE:
+    bump(node->cond);
+    bump(node->body);
+    return;
+  case '=':
+    bump(node->lhs);
+    bump(node->rhs);
+    if (node->lhs->ty == ND_IDENT)
+      node->lhs->var->version++;
+    return;
+  default:
+    bump(node->lhs);
+    bump(node->rhs);
+  }
+}
+
+// Numbers the values computed by the expression at *p in evaluation order,
+// replacing the ones already computed in the block.
+static void number(Node **p) {
+  Node *node = *p;
+  if (node == NULL)
+    return;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+    return;
+  case ND_CALL:
+    // The arguments are evaluated from left to right (see gen_args()), so
+    // a value computed in one is available in the ones after it.
+    for (int i = 0; i < node->args->len; i++)
+      number((Node **)&node->args->data[i]);
+    return;
+  case ND_ADDR:
+    if (node->expr->ty == ND_DEREF)
+      number(&node->expr->expr);
+    return;
+  case ND_DEREF:
+    number(&node->expr);
+    return;
+  case ND_INC:
+  case ND_DEC:
+    if (node->expr->ty == ND_IDENT)
+      node->expr->var->version++;
+    else
+      number(&node->expr->expr);
+    return;
+  case ND_AND:
+  case ND_OR:
+    // The rhs is not always evaluated, so nothing computed in it is
+    // available afterwards.
+    number(&node->lhs);
+    bump(node->rhs);
+    return;
+  case ND_INLINE:
+    bump(node->body);
+    return;
+  case '=':
+  case ND_OPASSIGN:
+    if (node->lhs->ty == ND_DEREF)
+      number(&node->lhs->expr);
+    number(&node->rhs);
+    if (node->lhs->ty == ND_IDENT)
+      node->lhs->var->version++;
+    return;
+  }
+
+  char *k = is_expensive(node) ? key(node) : NULL;
+  if (k) {
+    Value *v = map_get(values, k);
+    if (v) {
+      if (v->tmp == NULL) {
+        v->tmp = new_temp(func, (*v->site)->cty);
+        *v->site = new_assign(v->tmp, *v->site);
+      }
+      *p = new_ident(v->tmp);
+      return;
+    }
+  }
+  number(&node->lhs);
+  number(&node->rhs);
+  if (k) {
+    Value *v = alloc(sizeof(Value));
+    v->site = p;
+    map_set(values, k, v);
+  }
+}
+
+// Numbers the statement at *p. Control flow ends the basic block.
+static void stmt(Node **p) {
+  Node *node = *p;
+  if (node == NULL)
+    return;
+  switch (node->ty) {
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      stmt((Node **)&node->stmts->data[i]);
+    return;
+  case ND_IF:
+    number(&node->cond);
+    values = new_map();
+    stmt(&node->then);
+    values = new_map();
+    stmt(&node->els);
+    values = new_map();
+    return;
+  case ND_FOR:
+    number(&node->init);
+    bump(node->cond);
+    bump(node->after);
+    values = new_map();
+    stmt(&node->body);
+    values = new_map();
+    return;
+  case ND_VECTOR:
+    // The body is not numbered, so that it keeps its form.
+    bump(node);
+    values = new_map();
+    return;
+  case ND_WHILE:
+    bump(node->cond);
+    values = new_map();
+    stmt(&node->body);
+    values = new_map();
+    return;
+  case ND_SWITCH:
+    number(&node->cond);
+    values = new_map();
+    stmt(&node->body);
+    values = new_map();
+    return;
+  case ND_CASE:
+    values = new_map();
+    return;
+  case ND_BREAK:
+    return;
+  case ND_RETURN:
+    number(&node->expr);
+    return;
+  case ND_INITS:
+    for (int i = 0; i < node->inits->len; i++)
+      number((Node **)&node->inits->data[i]);
+    return;
+  default:
+    number(p);
+  }
+}
+
+static void cse_func(Node *node) {
+  func = node;
+  mark_escaped(func->body);
+  values = new_map();
+  stmt(&func->body);
+}
+
+/**
+ * Eliminates common subexpressions in basic blocks: an arithmetic
+ * expression on local variables computed again before any of them is
+ * assigned is kept in a temporary. Takes either the root or a single
+ * function.
+ */
+Node *cse(Node *node) {
+  if (!cse_exprs)
+    return node;
+  if (node->ty == ND_FUNC) {
+    cse_func(node);
+    return node;
+  }
+  for (int i = 0; i < node->funcs->len; i++)
+    cse_func(node->funcs->data[i]);
+  return node;
+}
@@ -0,0 +1,367 @@
+#include "mdcc.h"
+
+static Node *walk(Node *node);
+
+static bool has_side_effect(int ty) {
+  switch (ty) {
+  case '=':
+  case ND_OPASSIGN:
+  case ND_INC:
+  case ND_DEC:
+  case ND_CALL:
+  case ND_INLINE:
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Returns an expression with the same side effects as the value of node is
+ * discarded, or NULL if it has none.
+ */
+static Node *strip(Node *node) {
+  if (node == NULL || has_side_effect(node->ty))
+    return node;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+    return NULL;
+  case ND_ADDR:
+  case ND_DEREF:
+    return strip(node->expr);
+  case ND_AND:
+  case ND_OR:
+    // The rhs is conditionally evaluated, so the node is kept if it has
+    // side effects.
+    if (strip(node->rhs))
+      return node;
+    return strip(node->lhs);
+  default: {
+    Node *lhs = strip(node->lhs);
+    Node *rhs = strip(node->rhs);
+    if (lhs && rhs)
+      return node;
+    return lhs ? lhs : rhs;
+  }
+  }
+}
+
+static bool is_expr(Node *node) {
+  switch (node->ty) {
+  case ND_COMP_STMT:
+  case ND_RETURN:
+  case ND_IF:
+  case ND_FOR:
+  case ND_WHILE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_BREAK:
+  case ND_INITS:
+  case ND_NULL:
+    return false;
+  }
+  return true;
+}
+
+// Returns true if control never reaches the statement after node.
+static bool returns(Node *node) {
+  if (node == NULL)
+    return false;
+  switch (node->ty) {
+  case ND_RETURN:
+  case ND_BREAK:
+    return true;
+  case ND_COMP_STMT:
+    return node->stmts->len > 0 &&
+           returns(node->stmts->data[node->stmts->len - 1]);
+  case ND_IF:
+    return returns(node->then) && returns(node->els);
+  }
+  return false;
+}
+
+// Simplifies a statement, returning NULL if it does nothing.
+static Node *stmt(Node *node) {
+  if (node == NULL)
+    return NULL;
+  if (is_expr(node))
+    return strip(walk(node));
+
+  switch (node->ty) {
+  case ND_NULL:
+    return NULL;
+  case ND_COMP_STMT: {
+    Vector *stmts = new_vec();
+    bool dead = false;
+    for (int i = 0; i < node->stmts->len; i++) {
+      Node *s = node->stmts->data[i];
+      // The rest of the block is unreachable up to the next case label.
+      if (dead && s->ty != ND_CASE)
+        continue;
+      s = stmt(s);
+      if (s == NULL)
+        continue;
+      vec_push(stmts, s);
+      dead = returns(s);
+    }
+    node->stmts = stmts;
+    return node;
+  }
+  case ND_IF:
+    node->cond = walk(node->cond);
+    if (node->cond->ty == ND_NUM)
+      return stmt(node->cond->val ? node->then : node->els);
+    node->then = stmt(node->then);
+    node->els = stmt(node->els);
+    if (node->then == NULL && node->els == NULL)
+      return strip(node->cond);
+    if (node->then == NULL)
+      node->then = alloc_node(ND_NULL);
+    return node;
+  case ND_FOR:
+    node->init = stmt(node->init);
+    // An empty condition is NULL when the loop is simplified again.
+    node->cond = walk(node->cond);
+    if (node->cond && node->cond->ty == ND_NULL)
+      node->cond = NULL;
+    else if (node->cond && node->cond->ty == ND_NUM && node->cond->val == 0)
+      return node->init;
+    node->after = stmt(node->after);
+    node->body = stmt(node->body);
+    return node;
+  case ND_WHILE:
+    node->cond = walk(node->cond);
+    if (node->cond->ty == ND_NUM && node->cond->val == 0)
+      return NULL;
+    node->body = stmt(node->body);
+    return node;
+  case ND_SWITCH:
+    node->cond = walk(node->cond);
+    node->body = stmt(node->body);
+    return node;
+  case ND_RETURN:
+    node->expr = walk(node->expr);
+    return node;
+  case ND_INITS:
+    for (int i = 0; i < node->inits->len; i++)
+      node->inits->data[i] = walk(node->inits->data[i]);
+    return node;
+  }
+  return node;
+}
+
+static Node *walk(Node *node) {
+  if (node == NULL)
+    return NULL;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+    return node;
+  case ND_CALL:
+    for (int i = 0; i < node->args->len; i++)
+      node->args->data[i] = walk(node->args->data[i]);
+    return node;
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_INC:
+  case ND_DEC:
+    node->expr = walk(node->expr);
+    return node;
+  case ND_INLINE:
+    node->body = stmt(node->body);
+    if (node->body == NULL)
+      node->body = alloc_node(ND_NULL);
+    return node;
+  default:
+    node->lhs = walk(node->lhs);
+    node->rhs = walk(node->rhs);
+    return node;
+  }
+}
+
+static void mark_used(Node *node) {
+  if (node == NULL)
+    return;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return;
+  case ND_IDENT:
+    node->var->used = true;
+    return;
+  case ND_INITS:
+    node->var->used = true;
+    for (int i = 0; i < node->inits->len; i++)
+      mark_used(node->inits->data[i]);
+    return;
+  case ND_CALL:
+    for (int i = 0; i < node->args->len; i++)
+      mark_used(node->args->data[i]);
+    return;
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      mark_used(node->stmts->data[i]);
+    return;
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_INC:
+  case ND_DEC:
+    mark_used(node->expr);
+    return;
+  case ND_IF:
+    mark_used(node->cond);
+    mark_used(node->then);
+    mark_used(node->els);
+    return;
+  case ND_FOR:
+    mark_used(node->init);
+    mark_used(node->cond);
+    mark_used(node->after);
+    mark_used(node->body);
+    return;
+  case ND_WHILE:
+  case ND_SWITCH:
+    mark_used(node->cond);
+    mark_used(node->body);
+    return;
+  case ND_INLINE:
+    mark_used(node->body);
+    return;
+  case '=':
+    // Storing to a variable is not a use of it.
+    if (node->lhs->ty != ND_IDENT)
+      mark_used(node->lhs);
+    mark_used(node->rhs);
+    return;
+  default:
+    mark_used(node->lhs);
+    mark_used(node->rhs);
+  }
+}
+
+// Replaces the stores to unused local variables with their right-hand
+// sides. Globals may be read by other functions.
+static Node *drop_stores(Node *node) {
+  if (node == NULL)
+    return NULL;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return node;
+  case ND_INITS:
+    for (int i = 0; i < node->inits->len; i++)
+      node->inits->data[i] = drop_stores(node->inits->data[i]);
+    return node;
+  case ND_CALL:
+    for (int i = 0; i < node->args->len; i++)
+      node->args->data[i] = drop_stores(node->args->data[i]);
+    return node;
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      node->stmts->data[i] = drop_stores(node->stmts->data[i]);
+    return node;
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_INC:
+  case ND_DEC:
+    node->expr = drop_stores(node->expr);
+    return node;
+  case ND_IF:
+    node->cond = drop_stores(node->cond);
+    node->then = drop_stores(node->then);
+    node->els = drop_stores(node->els);
+    return node;
+  case ND_FOR:
+    node->init = drop_stores(node->init);
+    node->cond = drop_stores(node->cond);
+    node->after = drop_stores(node->after);
+    node->body = drop_stores(node->body);
+    return node;
+  case ND_WHILE:
+  case ND_SWITCH:
+  case ND_INLINE:
+    node->cond = drop_stores(node->cond);
+    node->body = drop_stores(node->body);
+    return node;
+  case '=':
+    node->rhs = drop_stores(node->rhs);
+    if (node->lhs->ty == ND_IDENT && !node->lhs->var->used &&
+        !node->lhs->var->label) {
+      // The value of an assignment is that of the converted rhs.
+      if (node->rhs->cty && node->rhs->cty->size <= node->cty->size)
+        return node->rhs;
+      // The store truncates, so it stays, and so does the variable.
+      node->lhs->var->used = true;
+    }
+    node->lhs = drop_stores(node->lhs);
+    return node;
+  default:
+    node->lhs = drop_stores(node->lhs);
+    node->rhs = drop_stores(node->rhs);
+    return node;
+  }
+}
+
+static bool is_param(Node *func, Var *var) {
+  for (int i = 0; i < func->params->len; i++)
+    if (((Node *)func->params->data[i])->var == var)
+      return true;
+  return false;
+}
+
+static Vector *used_vars(Node *func) {
+  Vector *vars = new_vec();
+  for (int i = 0; i < func->func_vars->len; i++) {
+    Var *var = func->func_vars->data[i];
+    if (var->used || is_param(func, var))
+      vec_push(vars, var);
+  }
+  return vars;
+}
+
+static void dce_func(Node *func) {
+  func->body = stmt(func->body);
+  if (func->body == NULL) {
+    func->body = alloc_node(ND_COMP_STMT);
+    func->body->stmts = new_vec();
+  }
+
+  // Drop the variables that are never read. Removing the stores to them
+  // can leave others unused, so repeat until nothing changes.
+  for (;;) {
+    for (int i = 0; i < func->func_vars->len; i++)
+      ((Var *)func->func_vars->data[i])->used = false;
+    mark_used(func->body);
+    if (used_vars(func)->len == func->func_vars->len)
+      break;
+    func->body = stmt(drop_stores(func->body));
+    Vector *vars = used_vars(func);
+    if (vars->len == func->func_vars->len)
+      break;
+    func->func_vars = vars;
+  }
+}
+
+/**
+ * Removes statements after returns, expression statements without side
+ * effects, branches with constant conditions and variables that are never
+ * read. Takes either the root or a single function.
+ */
+Node *dce(Node *node) {
+  if (node->ty == ND_FUNC) {
+    dce_func(node);
+    return node;
+  }
+  for (int i = 0; i < node->funcs->len; i++)
+    dce_func(node->funcs->data[i]);
+  return node;
+}
@@ -0,0 +1,153 @@
+#include "mdcc.h"
+
+// Leaf functions with at most this many nodes are inlined.
+#define INLINE_SIZE_LIMIT 40
+
+typedef struct {
+  Node *func;
+  int size;  // number of nodes in the body
+  bool leaf; // calls no function at all
+} Callee;
+
+static Map *callees; // function name -> Callee
+static Node *caller;
+
+// Returns why the call cannot be inlined, or NULL if it can.
+static char *reject(Node *call, Callee *c) {
+  if (c == NULL)
+    return "not defined in this file";
+  if (!c->leaf)
+    return "not a leaf function";
+  if (c->size > INLINE_SIZE_LIMIT)
+    return format("too large (%d nodes)", c->size);
+  if (call->args->len != c->func->params->len)
+    return "wrong number of arguments";
+  for (int i = 0; i < c->func->params->len; i++) {
+    Node *param = c->func->params->data[i];
+    if (param->var->has_address)
+      return "array parameter";
+  }
+  return NULL;
+}
+
+/**
+ * Replaces a call with an ND_INLINE node whose body assigns the arguments
+ * to copies of the parameters and then runs a copy of the callee's body.
+ */
+static Node *inline_call(Node *call, Node *func) {
+  Vector *from_vars = func->func_vars;
+  Vector *to_vars = new_vec();
+  for (int i = 0; i < from_vars->len; i++) {
+    Var *var = from_vars->data[i];
+    Var *copy = new_temp(caller, var->ty);
+    copy->name = var->name;
+    vec_push(to_vars, copy);
+  }
+
+  Node *body = alloc_node(ND_COMP_STMT);
+  body->stmts = new_vec();
+  for (int i = 0; i < func->params->len; i++) {
+    Node *param = copy_node(func->params->data[i], from_vars, to_vars);
+    Node *node = new_node('=', param, call->args->data[i]);
+    node->cty = param->cty;
+    vec_push(body->stmts, node);
+  }
+  vec_push(body->stmts, copy_node(func->body, from_vars, to_vars));
+
+  Node *node = alloc_node(ND_INLINE);
+  node->name = func->name;
+  node->body = body;
+  node->cty = call->cty;
+  return node;
+}
+
+static Node *walk(Node *node) {
+  if (node == NULL)
+    return NULL;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return node;
+  case ND_CALL: {
+    for (int i = 0; i < node->args->len; i++)
+      node->args->data[i] = walk(node->args->data[i]);
+    Callee *c = map_get(callees, node->name);
+    char *reason = reject(node, c);
+    if (inline_report) {
+      if (reason)
+        fprintf(stderr, "%s: not inlined call to %s: %s\n", caller->name,
+                node->name, reason);
+      else
+        fprintf(stderr, "%s: inlined call to %s (%d nodes)\n", caller->name,
+                node->name, c->size);
+    }
+    if (reason)
+      return node;
+    return inline_call(node, c->func);
+  }
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      node->stmts->data[i] = walk(node->stmts->data[i]);
+    return node;
+  case ND_INITS:
+    for (int i = 0; i < node->inits->len; i++)
+      node->inits->data[i] = walk(node->inits->data[i]);
+    return node;
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_INC:
+  case ND_DEC:
+    node->expr = walk(node->expr);
+    return node;
+  case ND_IF:
+    node->cond = walk(node->cond);
+    node->then = walk(node->then);
+    node->els = walk(node->els);
+    return node;
+  case ND_FOR:
+    node->init = walk(node->init);
+    node->cond = walk(node->cond);
+    node->after = walk(node->after);
+    node->body = walk(node->body);
+    return node;
+  case ND_WHILE:
+  case ND_SWITCH:
+    node->cond = walk(node->cond);
+    node->body = walk(node->body);
+    return node;
+  default:
+    node->lhs = walk(node->lhs);
+    node->rhs = walk(node->rhs);
+    return node;
+  }
+}
+
+/**
+ * Inlines calls to small leaf functions. The callees are left in place;
+ * callgraph() removes the ones that are no longer called.
+ */
+Node *inline_calls(Node *node) {
+  callees = new_map();
+  for (int i = 0; i < node->funcs->len; i++) {
+    Node *func = node->funcs->data[i];
+    Callee *c = alloc(sizeof(Callee));
+    c->func = func;
+    c->size = count_nodes(func->body);
+    Vector *calls = new_vec();
+    collect_calls(func->body, calls);
+    c->leaf = calls->len == 0;
+    map_set(callees, func->name, c);
+  }
+
+  // Leaf functions have no calls to inline, so the bodies copied from them
+  // never change while the callers are rewritten.
+  for (int i = 0; i < node->funcs->len; i++) {
+    caller = node->funcs->data[i];
+    caller->body = walk(caller->body);
+  }
+  return node;
+}
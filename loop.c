@@ -0,0 +1,580 @@
+#include "mdcc.h"
+
+static Node *func;
+
+// Variables assigned in the loop being optimized.
+static Vector *assigned;
+
+static bool contains(Vector *v, void *elm) {
+  for (int i = 0; i < v->len; i++)
+    if (v->data[i] == elm)
+      return true;
+  return false;
+}
+
+static void collect_assigned(Node *node, Vector *vars);
+
+static void collect_all(Vector *nodes, Vector *vars) {
+  for (int i = 0; i < nodes->len; i++)
+    collect_assigned(nodes->data[i], vars);
+}
+
+static void collect_assigned(Node *node, Vector *vars) {
+  if (node == NULL)
+    return;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return;
+  case ND_CALL:
+    collect_all(node->args, vars);
+    return;
+  case ND_COMP_STMT:
+    collect_all(node->stmts, vars);
+    return;
+  case ND_INITS:
+    vec_push(vars, node->var);
+    collect_all(node->inits, vars);
+    return;
+  case ND_INC:
+  case ND_DEC:
+    if (node->expr->ty == ND_IDENT)
+      vec_push(vars, node->expr->var);
+    collect_assigned(node->expr, vars);
+    return;
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+    collect_assigned(node->expr, vars);
+    return;
+  case ND_IF:
+    collect_assigned(node->cond, vars);
+    collect_assigned(node->then, vars);
+    collect_assigned(node->els, vars);
+    return;
+  case ND_FOR:
+  case ND_VECTOR:
+    collect_assigned(node->init, vars);
+    collect_assigned(node->cond, vars);
+    collect_assigned(node->after, vars);
+    collect_assigned(node->body, vars);
+    return;
+  case ND_WHILE:
+  case ND_SWITCH:
+  case ND_INLINE:
+    collect_assigned(node->cond, vars);
+    collect_assigned(node->body, vars);
+    return;
+  case '=':
+    if (node->lhs->ty == ND_IDENT)
+      vec_push(vars, node->lhs->var);
+    // fallthrough
+  default:
+    collect_assigned(node->lhs, vars);
+    collect_assigned(node->rhs, vars);
+  }
+}
+
+/**
+ * Returns true if node has the same value in every iteration of the loop.
+ * Such expressions can be computed before the loop even if the loop runs no
+ * iteration, so memory reads and divisions, which may trap, are excluded.
+ */
+static bool is_invariant(Node *node) {
+  switch (node->ty) {
+  case ND_NUM:
+    return true;
+  case ND_IDENT:
+    return !contains(assigned, node->var) && !node->var->escaped;
+  case ND_ADDR:
+    if (node->expr->ty == ND_IDENT)
+      return true;
+    return node->expr->ty == ND_DEREF && is_invariant(node->expr->expr);
+  case '+':
+  case '-':
+  case '*':
+  case '&':
+  case '|':
+  case '^':
+  case ND_SHL:
+  case ND_SHR:
+  case ND_EQ:
+  case ND_NEQ:
+  case '<':
+  case '>':
+    return is_invariant(node->lhs) && is_invariant(node->rhs);
+  }
+  return false;
+}
+
+static bool same(Node *x, Node *y) {
+  if (x->ty != y->ty)
+    return false;
+  switch (x->ty) {
+  case ND_NUM:
+    return x->val == y->val;
+  case ND_IDENT:
+    return x->var == y->var;
+  case ND_ADDR:
+  case ND_DEREF:
+    return same(x->expr, y->expr);
+  }
+  return x->lhs && y->lhs && same(x->lhs, y->lhs) && same(x->rhs, y->rhs);
+}
+
+/**
+ * An induction variable "var" is incremented by "step" at the end of each
+ * iteration, and nowhere else in the loop. An address "base + var * size"
+ * with an invariant base is replaced by a pointer "ptr" that is incremented
+ * by step * size along with it.
+ */
+typedef struct {
+  Var *var;
+  int step;
+  Vector *bases; // base address of each pointer
+  Vector *sizes;
+  Vector *ptrs;
+} IndVar;
+
+// Returns the variable incremented by node, setting the step.
+static Var *incremented(Node *node, int *step) {
+  if (node == NULL)
+    return NULL;
+  if (node->ty == ND_INC || node->ty == ND_DEC) {
+    if (node->expr->ty != ND_IDENT)
+      return NULL;
+    *step = node->ty == ND_INC ? 1 : -1;
+    return node->expr->var;
+  }
+  // i = i + c, i = i - c
+  if (node->ty != '=' || node->lhs->ty != ND_IDENT)
+    return NULL;
+  Node *rhs = node->rhs;
+  if ((rhs->ty != '+' && rhs->ty != '-') || rhs->lhs->ty != ND_IDENT ||
+      rhs->lhs->var != node->lhs->var || rhs->rhs->ty != ND_NUM)
+    return NULL;
+  *step = rhs->ty == '+' ? rhs->rhs->val : -rhs->rhs->val;
+  return node->lhs->var;
+}
+
+// If node is base + iv * size, returns the pointer replacing it.
+static Node *reduce(Node *node, IndVar *iv, Vector *pre) {
+  if (node->ty != '+' || node->cty->ty != TY_PTR)
+    return NULL;
+  Node *idx = node->rhs;
+  int size = 1;
+  if (idx->ty == '*' && idx->rhs->ty == ND_NUM) {
+    size = idx->rhs->val;
+    idx = idx->lhs;
+  }
+  if (idx->ty != ND_IDENT || idx->var != iv->var || !is_invariant(node->lhs))
+    return NULL;
+
+  for (int i = 0; i < iv->ptrs->len; i++)
+    if ((intptr_t)iv->sizes->data[i] == size &&
+        same(iv->bases->data[i], node->lhs))
+      return new_ident(iv->ptrs->data[i]);
+
+  Var *ptr = new_temp(func, node->cty);
+  vec_push(pre, new_assign(ptr, node));
+  vec_push(iv->bases, node->lhs);
+  vec_push(iv->sizes, (void *)(intptr_t)size);
+  vec_push(iv->ptrs, ptr);
+  return new_ident(ptr);
+}
+
+// Worth keeping in a temporary instead of recomputing.
+static bool is_expensive(Node *node) {
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+    return false;
+  case ND_ADDR:
+    return node->expr->ty != ND_IDENT;
+  }
+  // Constants are folded by a later pass.
+  return !(node->lhs->ty == ND_NUM && node->rhs->ty == ND_NUM);
+}
+
+/**
+ * Rewrites the expressions in the loop: addresses derived from the
+ * induction variable iv, if any, become pointers, and invariant
+ * computations are moved to temporaries assigned in pre.
+ */
+static Node *rewrite(Node *node, IndVar *iv, Vector *pre) {
+  if (node == NULL)
+    return NULL;
+  if (iv) {
+    Node *ptr = reduce(node, iv, pre);
+    if (ptr)
+      return ptr;
+  }
+  if (is_invariant(node)) {
+    if (!is_expensive(node))
+      return node;
+    Var *tmp = new_temp(func, node->cty);
+    vec_push(pre, new_assign(tmp, node));
+    return new_ident(tmp);
+  }
+
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+  case ND_VECTOR: // its body keeps the form gen_vector() expects
+    return node;
+  case ND_CALL:
+    for (int i = 0; i < node->args->len; i++)
+      node->args->data[i] = rewrite(node->args->data[i], iv, pre);
+    return node;
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      node->stmts->data[i] = rewrite(node->stmts->data[i], iv, pre);
+    return node;
+  case ND_INITS:
+    for (int i = 0; i < node->inits->len; i++)
+      node->inits->data[i] = rewrite(node->inits->data[i], iv, pre);
+    return node;
+  case ND_ADDR:
+  case ND_INC:
+  case ND_DEC:
+    // Only the address of an lvalue is computed.
+    if (node->expr->ty == ND_DEREF)
+      node->expr->expr = rewrite(node->expr->expr, iv, pre);
+    return node;
+  case ND_DEREF:
+  case ND_RETURN:
+    node->expr = rewrite(node->expr, iv, pre);
+    return node;
+  case ND_IF:
+    node->cond = rewrite(node->cond, iv, pre);
+    node->then = rewrite(node->then, iv, pre);
+    node->els = rewrite(node->els, iv, pre);
+    return node;
+  case ND_FOR:
+    node->init = rewrite(node->init, iv, pre);
+    node->cond = rewrite(node->cond, iv, pre);
+    node->after = rewrite(node->after, iv, pre);
+    node->body = rewrite(node->body, iv, pre);
+    return node;
+  case ND_WHILE:
+  case ND_SWITCH:
+  case ND_INLINE:
+    node->cond = rewrite(node->cond, iv, pre);
+    node->body = rewrite(node->body, iv, pre);
+    return node;
+  case '=':
+  case ND_OPASSIGN:
+    if (node->lhs->ty == ND_DEREF)
+      node->lhs->expr = rewrite(node->lhs->expr, iv, pre);
+    node->rhs = rewrite(node->rhs, iv, pre);
+    return node;
+  default:
+    node->lhs = rewrite(node->lhs, iv, pre);
+    node->rhs = rewrite(node->rhs, iv, pre);
+    return node;
+  }
+}
+
+// Loops whose unrolled body would have more nodes than this are not
+// unrolled.
+#define UNROLL_SIZE_LIMIT 400
+
+/**
+ * Unrolls a counted loop "for (; i < n; i += step)" with an invariant n by
+ * adding a loop before it that runs `unroll` iterations per test while
+ * that many are left. The original loop runs the remaining iterations.
+ */
+static bool unroll_loop(Node *loop, Var *var, int step, Vector *pre) {
+  Node *cond = loop->cond;
+  if (unroll < 2 || cond == NULL)
+    return false;
+  if (!(cond->ty == '<' && step > 0) && !(cond->ty == '>' && step < 0))
+    return false;
+  if (cond->lhs->ty != ND_IDENT || cond->lhs->var != var ||
+      !is_invariant(cond->rhs) || cond->cty->size < 4)
+    return false;
+  if ((count_nodes(loop->body) + count_nodes(loop->after)) * unroll >
+      UNROLL_SIZE_LIMIT)
+    return false;
+
+  // The last iteration of a round runs while i + (unroll - 1) * step < n.
+  // The limit is computed in 64 bits, where n - (unroll - 1) * step cannot
+  // overflow for an int n. A long n must be a constant, which is within
+  // the range of an int.
+  if (cond->cty->size == 8 && cond->rhs->ty != ND_NUM)
+    return false;
+  Var *lim = new_temp(func, new_long_ty());
+  Node *sub = new_node('-', cond->rhs, new_node_num((unroll - 1) * step));
+  sub->cty = lim->ty;
+  vec_push(pre, new_assign(lim, sub));
+
+  Node *node = alloc_node(ND_FOR);
+  node->cond = new_node(cond->ty, new_ident(var), new_ident(lim));
+  node->cond->cty = lim->ty;
+  node->body = alloc_node(ND_COMP_STMT);
+  node->body->stmts = new_vec();
+  for (int i = 0; i < unroll; i++) {
+    if (i > 0)
+      vec_push(node->body->stmts, copy_node(loop->after, NULL, NULL));
+    vec_push(node->body->stmts, copy_node(loop->body, NULL, NULL));
+  }
+  node->after = copy_node(loop->after, NULL, NULL);
+  vec_push(pre, node);
+  return true;
+}
+
+/**
+ * A counted loop being vectorized: its induction variable, the size of the
+ * array elements it works on, and the arrays and invariant operands it
+ * uses, which gen_vector() keeps in registers.
+ */
+typedef struct {
+  Var *var;
+  int size;
+  Vector *bases;
+  Vector *invariants;
+} VecLoop;
+
+// Returns true if node is the address of element var of an array, "base +
+// var * size" with an invariant base.
+static bool is_vector_addr(Node *node, VecLoop *v) {
+  if (node->ty != '+' || node->cty->ty != TY_PTR ||
+      node->cty->ptr_to->ty == TY_ARR || node->cty->ptr_to->size != v->size)
+    return false;
+  Node *idx = node->rhs;
+  if (idx->ty == '*' && idx->rhs->ty == ND_NUM && idx->rhs->val == v->size)
+    idx = idx->lhs;
+  else if (v->size > 1)
+    return false;
+  if (idx->ty != ND_IDENT || idx->var != v->var)
+    return false;
+
+  Node *base = node->lhs;
+  Var *var;
+  if (base->ty == ND_ADDR && base->expr->ty == ND_IDENT &&
+      base->expr->var->ty->ty == TY_ARR)
+    var = base->expr->var;
+  else if (base->ty == ND_IDENT && base->var->ty->ty == TY_PTR &&
+           !base->var->label && is_invariant(base))
+    var = base->var;
+  else
+    return false;
+  if (!contains(v->bases, var))
+    vec_push(v->bases, var);
+  return v->bases->len <= VECTOR_BASES;
+}
+
+static bool add_invariant(Node *node, VecLoop *v) {
+  for (int i = 0; i < v->invariants->len; i++) {
+    Node *inv = v->invariants->data[i];
+    if (same(inv, node))
+      return true;
+  }
+  vec_push(v->invariants, node);
+  return v->invariants->len <= VECTOR_INVARIANTS;
+}
+
+/**
+ * Returns true if node computes each element from the elements of the
+ * arrays with packed operations. The low bits of a sum, difference or
+ * bitwise operation only depend on the low bits of its operands, so these
+ * may be done in a wider type than the elements. Shifts may not.
+ */
+static bool is_vector_expr(Node *node, VecLoop *v, int depth) {
+  if (depth > VECTOR_DEPTH)
+    return false;
+  switch (node->ty) {
+  case ND_NUM:
+    return add_invariant(node, v);
+  case ND_IDENT: {
+    Var *var = node->var;
+    if (var->label || var->ty->ty == TY_PTR || var->ty->ty == TY_ARR ||
+        var->ty->size < v->size || !is_invariant(node))
+      return false;
+    return add_invariant(node, v);
+  }
+  case ND_DEREF:
+    return is_vector_addr(node->expr, v);
+  case ND_SHL:
+  case ND_SHR:
+    // SSE2 has no packed byte shifts.
+    return v->size >= 4 && node->cty->size == v->size &&
+           node->rhs->ty == ND_NUM && node->rhs->val >= 0 &&
+           node->rhs->val < v->size * 8 &&
+           is_vector_expr(node->lhs, v, depth + 1);
+  case '+':
+  case '-':
+  case '&':
+  case '|':
+  case '^':
+    return node->cty->ty != TY_PTR && node->cty->size >= v->size &&
+           is_vector_expr(node->lhs, v, depth + 1) &&
+           is_vector_expr(node->rhs, v, depth + 1);
+  }
+  return false;
+}
+
+// Returns true if node stores an element computed by is_vector_expr().
+static bool is_vector_stmt(Node *node, VecLoop *v) {
+  if (node->ty != '=' || node->lhs->ty != ND_DEREF)
+    return false;
+  if (v->size == 0)
+    v->size = node->cty->size;
+  if (v->size != 1 && v->size != 4 && v->size != 8)
+    return false;
+  return is_vector_addr(node->lhs->expr, v) &&
+         is_vector_expr(node->rhs, v, 1);
+}
+
+/**
+ * Vectorizes a loop "for (; i < n; i++) a[i] = b[i] + c[i]; ..." with an
+ * invariant n whose body only stores elements i of int, long or char arrays
+ * computed from elements i and invariants, by adding a loop before it that
+ * runs the body on VECTOR_SIZE bytes of elements at a time. The original
+ * loop runs the remaining iterations.
+ */
+static bool vectorize_loop(Node *loop, Var *var, int step, Vector *pre) {
+  Node *cond = loop->cond;
+  if (!vectorize || step != 1 || cond == NULL || cond->ty != '<' ||
+      cond->lhs->ty != ND_IDENT || cond->lhs->var != var || var->label ||
+      var->ty->size < 4)
+    return false;
+  Node *n = cond->rhs;
+  if (n->ty != ND_NUM &&
+      (n->ty != ND_IDENT || n->var->label || n->var->ty->ty == TY_PTR ||
+       n->var->ty->ty == TY_ARR || !is_invariant(n)))
+    return false;
+
+  VecLoop v = {.var = var, .bases = new_vec(), .invariants = new_vec()};
+  Node *body = loop->body;
+  if (body->ty == ND_COMP_STMT) {
+    if (body->stmts->len == 0)
+      return false;
+    for (int i = 0; i < body->stmts->len; i++)
+      if (!is_vector_stmt(body->stmts->data[i], &v))
+        return false;
+  } else if (!is_vector_stmt(body, &v)) {
+    return false;
+  }
+
+  Node *node = alloc_node(ND_VECTOR);
+  node->cond = copy_node(cond, NULL, NULL);
+  node->body = copy_node(body, NULL, NULL);
+  node->after = copy_node(loop->after, NULL, NULL);
+  vec_push(pre, node);
+  return true;
+}
+
+static Node *optimize(Node *loop) {
+  assigned = new_vec();
+  collect_assigned(loop->cond, assigned);
+  collect_assigned(loop->body, assigned);
+
+  IndVar *iv = NULL;
+  int step;
+  Var *var = loop->ty == ND_FOR ? incremented(loop->after, &step) : NULL;
+  if (var && !contains(assigned, var) && !var->escaped &&
+      var->ty->ty != TY_PTR) {
+    iv = alloc(sizeof(IndVar));
+    iv->var = var;
+    iv->step = step;
+    iv->bases = new_vec();
+    iv->sizes = new_vec();
+    iv->ptrs = new_vec();
+  }
+  if (loop->ty == ND_FOR)
+    collect_assigned(loop->after, assigned);
+
+  // The preheader runs once before the loop.
+  Node *block = alloc_node(ND_COMP_STMT);
+  block->stmts = new_vec();
+  Vector *pre = block->stmts;
+  Node *init = loop->ty == ND_FOR ? loop->init : NULL;
+  if (init)
+    vec_push(pre, init);
+  if (iv)
+    vectorize_loop(loop, iv->var, step, pre);
+  if (loop_opt) {
+    loop->cond = rewrite(loop->cond, iv, pre);
+    loop->body = rewrite(loop->body, iv, pre);
+  }
+
+  if (iv && iv->ptrs->len > 0) {
+    Node *after = alloc_node(ND_COMP_STMT);
+    after->stmts = new_vec();
+    vec_push(after->stmts, loop->after);
+    for (int i = 0; i < iv->ptrs->len; i++) {
+      Var *ptr = iv->ptrs->data[i];
+      int size = (intptr_t)iv->sizes->data[i];
+      Node *add = new_node('+', new_ident(ptr), new_node_num(step * size));
+      add->cty = ptr->ty;
+      vec_push(after->stmts, new_assign(ptr, add));
+    }
+    loop->after = after;
+  }
+
+  bool unrolled = iv && unroll_loop(loop, iv->var, step, pre);
+  if (!unrolled && pre->len == (init ? 1 : 0))
+    return loop;
+  if (init)
+    loop->init = NULL;
+  vec_push(pre, loop);
+  return block;
+}
+
+// Optimizes the loops in node, innermost first.
+static Node *walk(Node *node) {
+  if (node == NULL)
+    return NULL;
+  switch (node->ty) {
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      node->stmts->data[i] = walk(node->stmts->data[i]);
+    return node;
+  case ND_IF:
+    node->then = walk(node->then);
+    node->els = walk(node->els);
+    return node;
+  case ND_FOR:
+  case ND_WHILE:
+    node->body = walk(node->body);
+    return optimize(node);
+  case ND_SWITCH:
+  case ND_INLINE:
+    node->body = walk(node->body);
+    return node;
+  case '=':
+    node->rhs = walk(node->rhs);
+    return node;
+  case ND_RETURN:
+    node->expr = walk(node->expr);
+    return node;
+  }
+  return node;
+}
+
+/**
+ * Moves loop-invariant computations out of loops and replaces addresses
+ * computed from induction variables by incremented pointers. Takes either
+ * the root or a single function. Counted loops over arrays are also
+ * vectorized, and counted loops are unrolled with -funroll.
+ */
+Node *opt_loops(Node *node) {
+  if (!loop_opt && unroll < 2 && !vectorize)
+    return node;
+  if (node->ty == ND_ROOT) {
+    for (int i = 0; i < node->funcs->len; i++)
+      opt_loops(node->funcs->data[i]);
+    return node;
+  }
+  func = node;
+  mark_escaped(node->body);
+  node->body = walk(node->body);
+  return node;
+}
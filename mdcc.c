@@ -3,8 +3,133 @@
 int pos = 0;
 int nvars;
 
+// Options
+int nthreads = 1;
+bool lazy_lex = false;
+bool stream_funcs = false;
+bool skim_funcs = false;
+bool cold_section = false;
+bool inline_funcs = true;
+bool inline_report = false;
+bool loop_opt = true;
+int unroll = 1;
+bool vectorize = true;
+bool reg_alloc = true;
+bool cse_exprs = true;
+bool omit_frame = true;
+bool tail_calls = true;
+bool jump_tables = true;
+bool stack_coloring = true;
+bool frame_report = false;
+
 static void usage() {
-  error("Usage:\nmdcc -e <code>\nmdcc -f <source file>\nmdcc -test");
+  error("Usage:\nmdcc [options] -e <code>\nmdcc [options] -f <source file>\n"
+        "mdcc -test\n\n"
+        "Options:\n"
+        "  -fthreads=<n>  Tokenize large inputs on <n> threads\n"
+        "  -flazy-lex     Produce tokens on demand while parsing\n"
+        "  -fstream       Compile and release functions one at a time\n"
+        "  -fskim         Parse only functions reachable from main\n"
+        "  -fcold-section Place functions only called on error paths in a\n"
+        "                 separate section\n"
+        "  -fno-inline    Do not inline calls to small leaf functions\n"
+        "  -finline-report\n"
+        "                 Report the inlining decisions\n"
+        "  -fno-loop-opt  Do not move invariant code out of loops or reduce\n"
+        "                 induction variables\n"
+        "  -funroll=<k>   Unroll counted loops <k> times\n"
+        "  -fno-vectorize Do not run loops over arrays with SSE2 instructions\n"
+        "  -fno-regalloc  Keep all local variables in the stack frame\n"
+        "  -fno-cse       Do not eliminate common subexpressions\n"
+        "  -fno-omit-frame-pointer\n"
+        "                 Set up rbp in leaf functions too\n"
+        "  -fno-tail-calls\n"
+        "                 Do not turn calls in tail position into jumps\n"
+        "  -fno-jump-tables\n"
+        "                 Dispatch switch statements by comparisons only\n"
+        "  -fno-stack-coloring\n"
+        "                 Give every local variable a stack slot of its own\n"
+        "  -fframe-report Report the size of the variables in each frame");
+}
+
+static bool parse_opt(char *arg) {
+  if (strncmp(arg, "-fthreads=", 10) == 0) {
+    nthreads = atoi(arg + 10);
+    if (nthreads < 1)
+      usage();
+    return true;
+  }
+  if (strcmp(arg, "-flazy-lex") == 0) {
+    lazy_lex = true;
+    return true;
+  }
+  if (strcmp(arg, "-fstream") == 0) {
+    stream_funcs = true;
+    return true;
+  }
+  if (strcmp(arg, "-fskim") == 0) {
+    skim_funcs = true;
+    return true;
+  }
+  if (strcmp(arg, "-fcold-section") == 0) {
+    cold_section = true;
+    return true;
+  }
+  if (strcmp(arg, "-fno-inline") == 0) {
+    inline_funcs = false;
+    return true;
+  }
+  if (strcmp(arg, "-finline-report") == 0) {
+    inline_report = true;
+    return true;
+  }
+  if (strncmp(arg, "-funroll=", 9) == 0) {
+    unroll = atoi(arg + 9);
+    if (unroll < 1)
+      usage();
+    return true;
+  }
+  if (strcmp(arg, "-fno-loop-opt") == 0) {
+    loop_opt = false;
+    return true;
+  }
+  if (strcmp(arg, "-fno-vectorize") == 0) {
+    vectorize = false;
+    return true;
+  }
+  if (strcmp(arg, "-fno-regalloc") == 0) {
+    reg_alloc = false;
+    return true;
+  }
+  if (strcmp(arg, "-fno-cse") == 0) {
+    cse_exprs = false;
+    return true;
+  }
+  if (strcmp(arg, "-fno-omit-frame-pointer") == 0) {
+    omit_frame = false;
+    return true;
+  }
+  if (strcmp(arg, "-fno-tail-calls") == 0) {
+    tail_calls = false;
+    return true;
+  }
+  if (strcmp(arg, "-fno-jump-tables") == 0) {
+    jump_tables = false;
+    return true;
+  }
+  if (strcmp(arg, "-fno-stack-coloring") == 0) {
+    stack_coloring = false;
+    return true;
+  }
+  if (strcmp(arg, "-fframe-report") == 0) {
+    frame_report = true;
+    return true;
+  }
+  return false;
+}
+
+static void compile_func(Node *func) {
+  gen_x64_func(cse(opt_loops(dce(const_prop(conv(func))))));
 }
 
 int main(int argc, char **argv) {
@@ -16,27 +141,51 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  if (argc != 3)
+  int i = 1;
+  while (i < argc && parse_opt(argv[i]))
+    i++;
+
+  if (argc - i != 2)
     usage();
 
-  if (strcmp(argv[1], "-e") == 0) {
-    buf = argv[2];
-  } else if (strcmp(argv[1], "-f") == 0) {
-    FILE *f = fopen(argv[2], "rb");
+  if (strcmp(argv[i], "-e") == 0) {
+    buf = argv[i + 1];
+  } else if (strcmp(argv[i], "-f") == 0) {
+    FILE *f = fopen(argv[i + 1], "rb");
+    if (f == NULL)
+      error("Cannot open %s", argv[i + 1]);
     fseek(f, 0, SEEK_END);
     long fsize = ftell(f);
     fseek(f, 0, SEEK_SET);
 
     buf = malloc(fsize + 1);
     fread(buf, fsize, 1, f);
+    buf[fsize] = '\0';
     fclose(f);
   } else {
     usage();
   }
 
-  Vector *tokens = tokenize();
-  Node *node = parse(tokens);
+  if (stream_funcs) {
+    gen_x64_header();
+    func_handler = compile_func;
+  }
+
+  // Skimming jumps back to function bodies, which needs all the tokens.
+  Node *node;
+  if (lazy_lex && !skim_funcs)
+    node = parse_stream(new_token_stream());
+  else
+    node = parse(tokenize());
+  if (stream_funcs) {
+    gen_x64_globals(node->globals);
+    return 0;
+  }
+
   node = conv(node);
+  if (inline_funcs)
+    node = inline_calls(node);
+  node = callgraph(cse(opt_loops(dce(const_prop(node)))));
   gen_x64(node);
   return 0;
 }
@@ -3,23 +3,40 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+// Number of elements a vector holds without allocating its data separately.
+// Most vectors are argument, parameter and statement lists of a few
+// elements.
+#define VEC_INLINE_SIZE 4
+
 typedef struct {
   void **data;
   int capacity;
   int len;
+  bool in_arena; // data is allocated from an arena
+  void *inline_data[VEC_INLINE_SIZE]; // data until the vector grows larger
 } Vector;
 
 typedef struct {
   Vector *keys;
   Vector *vals;
+
+  // Hash index of the entries. buckets[h] is the newest entry whose key
+  // hashes to h, and chain[i] is the next older entry with the same hash,
+  // or -1.
+  int *buckets;
+  int nbuckets;
+  Vector *chain;
+  bool in_arena; // buckets are allocated from an arena
 } Map;
 
 enum {
@@ -52,6 +69,10 @@ enum {
   TK_OR,      // ||
   TK_BOR_EQ,  // |=
   TK_XOR_EQ,  // ^=
+  TK_SWITCH,
+  TK_CASE,
+  TK_DEFAULT,
+  TK_BREAK,
   TK_EOF,
 };
 
@@ -78,6 +99,12 @@ enum {
   ND_DEC, // postfix decrement
   ND_WHILE,
   ND_INITS,
+  ND_INLINE,   // inlined function call
+  ND_OPASSIGN, // compound assignment
+  ND_SWITCH,
+  ND_CASE,   // case or default label
+  ND_BREAK,  // break out of a switch
+  ND_VECTOR, // vectorized counted loop
 };
 
 typedef struct Position {
@@ -123,6 +150,39 @@ typedef struct Var {
   // has_address is true if the variable is passed as
   // an pointer-like argument of a function.
   bool has_address;
+
+  // used is true if the variable is read or its address is taken.
+  // Computed by dce().
+  bool used;
+
+  // escaped is true if the address of the variable is taken, so it may be
+  // accessed through pointers. Computed by mark_escaped().
+  bool escaped;
+
+  // Known value of the variable while propagating constants.
+  bool is_const;
+  int const_val;
+
+  // Callee-saved register holding the variable, or 0 if it lives in the
+  // stack frame. uses weighs the references by loop depth.
+  int reg;
+  int uses;
+
+  // Number of assignments to the variable seen while numbering values.
+  int version;
+
+  // Number of loops around the declaration, and the positions of the first
+  // and last statements where the variable is live, computed when the
+  // frame is laid out.
+  int loop_depth;
+  int live_start;
+  int live_end;
+
+  // Assembly label of a global variable, or NULL for a local one. init is
+  // the vector of the constant values of its elements, or NULL if it is
+  // zero-initialized.
+  char *label;
+  Vector *init;
 } Var;
 
 struct Function;
@@ -145,49 +205,123 @@ struct Function;
  *
  *  While statement
  *  while ("cond") "body"
+ *
+ *  Inlined call of "name"
+ *  "body", whose returns jump to its end
+ *
+ *  Compound assignment, which computes the address of "lhs" once
+ *  "lhs" "op"= "rhs"
+ *
+ *  Switch statement, whose "body" is a compound statement
+ *  switch ("cond") "body"
+ *
+ *  Case label, only found among the statements of a switch body
+ *  case "cond": or default: if "cond" is NULL
+ *  "name" is the assembly label, set when the switch is generated.
+ *
+ *  Vectorized loop, followed by the loop it was made from
+ *  for (; "cond"; "after") "body", run VECTOR_SIZE bytes of elements at a
+ *  time while that many are left, or not at all if the arrays overlap.
+ *  The original loop runs the remaining iterations.
+ *
+ * A node only has the fields of its type. Nodes are allocated by
+ * alloc_node() with just enough room for them (see node_size()).
  */
 typedef struct Node {
-  int ty; // Node type
+  int ty;    // Node type
+  Type *cty; // C type.
 
-  struct Node *lhs;
-  struct Node *rhs;
+  union {
+    // ND_NUM
+    int val;
 
-  int val;
-  Var *var;
-  Type *cty; // C type.
-  char *name;
-  Vector *params;
-  struct Node *body;
-  Vector *func_vars;
-  Vector *args;
-  struct Node *expr;
-  struct Node *cond;
-  struct Node *then;
-  struct Node *els;
-  struct Node *init;
-  struct Node *after;
-
-  // Vector of statements
-  Vector *stmts;
-
-  // For the root node
-  Vector *funcs;
-
-  // For array reference
-  Vector *indice;
-
-  // For initializer
-  Vector *inits;
+    // Binary operators
+    struct {
+      struct Node *lhs;
+      struct Node *rhs;
+      int op; // ND_OPASSIGN
+    };
+
+    // ND_ADDR, ND_DEREF, ND_RETURN, ND_INC, ND_DEC
+    struct Node *expr;
+
+    // ND_IDENT, ND_INITS
+    struct {
+      Var *var;
+      Vector *inits;
+    };
+
+    // Vector of statements for ND_COMP_STMT
+    Vector *stmts;
+
+    // ND_ROOT
+    struct {
+      Vector *funcs;
+      Vector *globals;
+    };
+
+    // ND_CALL, ND_FUNC and statements
+    struct {
+      char *name;
+      union {
+        Vector *args;
+        Vector *params;
+      };
+      Vector *func_vars;
+      bool cold; // ND_FUNC: only called from error paths
+      struct Node *body;
+      struct Node *cond;
+      struct Node *then;
+      struct Node *els;
+      struct Node *init;
+      struct Node *after;
+    };
+  };
 } Node;
 
 // Basic block
 typedef struct BB {
 } BB;
 
-// main.c
+// Multiplier and shift dividing by a constant (see div_magic()).
+typedef struct {
+  long magic;
+  int shift;
+} DivMagic;
+
+// Bytes of the SSE registers a vectorized loop works on, and the most
+// arrays, invariant operands and nested operators it can use (see
+// gen_vector()).
+#define VECTOR_SIZE 16
+#define VECTOR_BASES 6
+#define VECTOR_INVARIANTS 8
+#define VECTOR_DEPTH 8
+
+// mdcc.c
+extern int nthreads;
+extern bool lazy_lex;
+extern bool stream_funcs;
+extern bool skim_funcs;
+extern bool cold_section;
+extern bool inline_funcs;
+extern bool inline_report;
+extern bool loop_opt;
+extern int unroll;
+extern bool vectorize;
+extern bool reg_alloc;
+extern bool cse_exprs;
+extern bool omit_frame;
+extern bool tail_calls;
+extern bool jump_tables;
+extern bool stack_coloring;
+extern bool frame_report;
 
 // util.c
 __attribute__((noreturn)) void error(char *fmt, ...);
+void arena_begin();
+void arena_end();
+void *alloc(size_t size);
+char *alloc_str(char *s);
 Vector *new_vec(void);
 void vec_push(Vector *v, void *elm);
 void *vec_pop(Vector *v);
@@ -195,31 +329,71 @@ Map *new_map(void);
 void map_set(Map *map, char *key, void *val);
 void *map_get(Map *map, char *key);
 void *map_get_def(Map *map, char *key, void *defv);
+unsigned hash_str(char *s);
 bool isnondigit(char c);
 char *format(char *fmt, ...);
 int roundup(int x, int align);
+DivMagic div_magic(long d, int bits);
 Type *new_type(int ty, int size);
 Type *ptr(Type *ty);
+size_t node_size(int ty);
+Node *alloc_node(int ty);
 Node *new_node(int ty, Node *lhs, Node *rhs);
 Node *new_node_one(int ty, Node *expr);
 Type *new_long_ty();
 Type *new_int_ty();
 Type *new_char_ty();
 Node *new_node_num(int val);
+Var *new_temp(Node *func, Type *ty);
+Node *new_ident(Var *var);
+Node *new_assign(Var *var, Node *rhs);
+bool is_tracked(Var *var);
+void collect_calls(Node *node, Vector *calls);
+void mark_escaped(Node *node);
+int count_nodes(Node *node);
+Node *copy_node(Node *node, Vector *from_vars, Vector *to_vars);
 
 // token.c
+typedef struct TokenStream TokenStream;
 extern char *buf;
 extern int pos;
 Vector *tokenize();
+TokenStream *new_token_stream();
+Token *stream_peek(TokenStream *ts, int p, int keep);
 
 // parse.c
-Node *parse();
+// If set, each function is passed to the handler as soon as it is parsed
+// instead of being collected into the root node.
+extern void (*func_handler)(Node *func);
+Node *parse(Vector *tokens);
+Node *parse_stream(TokenStream *ts);
 
 // conv.c
 Node *conv(Node *node);
 
+// inline.c
+Node *inline_calls(Node *node);
+
+// constprop.c
+Node *const_prop(Node *node);
+
+// dce.c
+Node *dce(Node *node);
+
+// loop.c
+Node *opt_loops(Node *node);
+
+// cse.c
+Node *cse(Node *node);
+
+// callgraph.c
+Node *callgraph(Node *node);
+
 // x64.c
 void gen_x64(Node *node);
+void gen_x64_header();
+void gen_x64_func(Node *func);
+void gen_x64_globals(Vector *globals);
 
 // test_util.c
 void test();
@@ -1,54 +1,109 @@
 #include "mdcc.h"
 
-typedef struct Scope {
-  struct Scope *outer;
-  Map *vars;
-} Scope;
+// Number of buckets of the symbol table. Must be a power of 2.
+#define SYMTAB_SIZE 4096
+
+// A declaration of a variable in a scope. Bindings in the same bucket are
+// chained, newest first, so inner declarations shadow outer ones.
+typedef struct Binding {
+  char *name;
+  Var *var;
+  int depth; // nesting depth of the declaring scope
+  struct Binding *next;
+} Binding;
 
 Vector *tokens;
-Scope *scope;
 Vector *func_vars;
+// Variables declared at file scope.
+static Vector *globals;
+// Number of loops around the statement being parsed.
+static int loop_depth;
 static Node node_null = {ND_NULL};
 
-inline static Token *peek(int p) { return tokens->data[p]; }
+// Tokens are read from the stream instead of the vector if it is set.
+static TokenStream *stream;
+// The oldest token position the parser may roll back to.
+static int mark = INT_MAX;
+
+void (*func_handler)(Node *func);
+
+inline static Token *peek(int p) {
+  if (stream) {
+    // Keep the token right before the current one, which callers may still
+    // refer to after consuming it.
+    int keep = pos - 1 < mark ? pos - 1 : mark;
+    return stream_peek(stream, p, keep);
+  }
+  return tokens->data[p];
+}
 
 static bool istypename() {
   return peek(pos)->ty == TK_LONG || peek(pos)->ty == TK_INT ||
          peek(pos)->ty == TK_CHAR;
 }
 
-static Scope *new_scope(Scope *outer) {
-  Scope *scope = malloc(sizeof(Scope));
-  scope->vars = new_map();
-  scope->outer = outer;
-  return scope;
+static Binding *symtab[SYMTAB_SIZE];
+// Bindings in the order of declaration.
+static Vector *undo_log;
+// Length of the undo log at the start of each open scope.
+static Vector *scope_starts;
+
+static unsigned hash(char *name) { return hash_str(name) & (SYMTAB_SIZE - 1); }
+
+static void enter_scope() {
+  vec_push(scope_starts, (void *)(intptr_t)undo_log->len);
 }
 
-static Var *lookup_var(char *name) {
-  for (Scope *s = scope; s != NULL; s = s->outer) {
-    Var *var = map_get(s->vars, name);
-    if (var)
-      return var;
+// Removes the bindings of the innermost scope. They are the newest in their
+// buckets, so they are always at the head of the chains.
+static void leave_scope() {
+  int start = (intptr_t)vec_pop(scope_starts);
+  while (undo_log->len > start) {
+    Binding *b = vec_pop(undo_log);
+    symtab[hash(b->name)] = b->next;
   }
-  return NULL;
 }
 
-static Var *lookup_var_scope(char *name) {
-  Var *var = map_get(scope->vars, name);
-  if (var)
-    return var;
+static Binding *lookup(char *name) {
+  for (Binding *b = symtab[hash(name)]; b != NULL; b = b->next)
+    if (!strcmp(b->name, name))
+      return b;
   return NULL;
 }
 
+static Var *lookup_var(char *name) {
+  Binding *b = lookup(name);
+  return b ? b->var : NULL;
+}
+
 static Var *new_var(Type *ty, char *name) {
-  if (lookup_var_scope(name) != NULL)
+  Binding *b = lookup(name);
+  if (b != NULL && b->depth == scope_starts->len)
     error("Redeclaration of '%s'", name);
-  Var *var = malloc(sizeof(Var));
+  Var *var = alloc(sizeof(Var));
   var->ty = ty;
   var->name = name;
   var->has_address = false;
-  map_set(scope->vars, name, (void *)var);
-  vec_push(func_vars, (void *)var);
+  var->loop_depth = loop_depth;
+
+  unsigned h = hash(name);
+  b = alloc(sizeof(Binding));
+  b->name = name;
+  b->var = var;
+  b->depth = scope_starts->len;
+  b->next = symtab[h];
+  symtab[h] = b;
+  vec_push(undo_log, b);
+
+  // Globals may be accessed by any function, so no pass follows their
+  // values.
+  if (b->depth == 0) {
+    var->label = format("_%s", name);
+    var->escaped = true;
+    vec_push(globals, var);
+  } else {
+    vec_push(func_vars, (void *)var);
+  }
   return var;
 }
 
@@ -79,10 +134,8 @@ static void expect(int ty) {
   bad_token(t, format("Expected token %d but got %d", ty, t->ty));
 }
 
-static Node *new_node_ident(char *name, Var *var) {
-  Node *node = malloc(sizeof(Node));
-  node->ty = ND_IDENT;
-  node->name = name;
+static Node *new_node_ident(Var *var) {
+  Node *node = alloc_node(ND_IDENT);
   node->var = var;
   node->cty = var->ty;
   return node;
@@ -95,11 +148,9 @@ static Node *assignment_expr();
 static Node *primary_expr() {
   if (peek(pos)->ty == TK_IDENT) {
     Token *tok = peek(pos++);
-    char *name = strdup(tok->name);
     if (consume('(')) {
-      Node *node = malloc(sizeof(Node));
-      node->ty = ND_CALL;
-      node->name = name;
+      Node *node = alloc_node(ND_CALL);
+      node->name = alloc_str(tok->name);
       node->args = new_vec();
       while (!consume(')')) {
         vec_push(node->args, (void *)assignment_expr());
@@ -110,9 +161,9 @@ static Node *primary_expr() {
       return node;
     } else {
       Var *var;
-      if ((var = lookup_var(name)) == NULL)
+      if ((var = lookup_var(tok->name)) == NULL)
         bad_token(tok, format("Undefined identifier %s", tok->name));
-      return new_node_ident(name, var);
+      return new_node_ident(var);
     }
   }
   if (peek(pos)->ty == TK_NUM) {
@@ -147,19 +198,21 @@ static Node *postfix_expr() {
 
 static Node *cast_expr();
 
+static Node *new_opassign(int op, Node *lhs, Node *rhs) {
+  Node *node = new_node(ND_OPASSIGN, lhs, rhs);
+  node->op = op;
+  return node;
+}
+
 static Node *unary_expr() {
   if (consume('&'))
     return new_node_one(ND_ADDR, cast_expr());
   if (consume('*'))
     return new_node_one(ND_DEREF, cast_expr());
-  if (consume(TK_INC)) {
-    Node *lhs = unary_expr();
-    return new_node('=', lhs, new_node('+', lhs, new_node_num(1)));
-  }
-  if (consume(TK_DEC)) {
-    Node *lhs = unary_expr();
-    return new_node('=', lhs, new_node('-', lhs, new_node_num(1)));
-  }
+  if (consume(TK_INC))
+    return new_opassign('+', unary_expr(), new_node_num(1));
+  if (consume(TK_DEC))
+    return new_opassign('-', unary_expr(), new_node_num(1));
   return postfix_expr();
 }
 
@@ -169,37 +222,53 @@ static void *decl();
 
 static Node *conditional_expr();
 
+static int assignment_op();
+
 static Node *assignment_expr() {
   int prev_pos = pos;
+  int prev_mark = mark;
+  if (pos < mark)
+    mark = pos;
   Node *lhs = unary_expr();
+  int op = assignment_op();
+  mark = prev_mark;
 
   // If next token is assignment operator, parse assignment-expression as rhs.
   // Otherwise, rollback the position of the token and parse
   // conditional-expression.
-  if (consume('=')) {
-    return new_node('=', lhs, assignment_expr());
-  } else if (consume(TK_ADD_EQ)) {
-    return new_node('=', lhs, new_node('+', lhs, assignment_expr()));
-  } else if (consume(TK_SUB_EQ)) {
-    return new_node('=', lhs, new_node('-', lhs, assignment_expr()));
-  } else if (consume(TK_MUL_EQ)) {
-    return new_node('=', lhs, new_node('*', lhs, assignment_expr()));
-  } else if (consume(TK_DIV_EQ)) {
-    return new_node('=', lhs, new_node('/', lhs, assignment_expr()));
-  } else if (consume(TK_SHL_EQ)) {
-    return new_node('=', lhs, new_node(ND_SHL, lhs, assignment_expr()));
-  } else if (consume(TK_SHR_EQ)) {
-    return new_node('=', lhs, new_node(ND_SHR, lhs, assignment_expr()));
-  } else if (consume(TK_BAND_EQ)) {
-    return new_node('=', lhs, new_node('&', lhs, assignment_expr()));
-  } else if (consume(TK_BOR_EQ)) {
-    return new_node('=', lhs, new_node('|', lhs, assignment_expr()));
-  } else if (consume(TK_XOR_EQ)) {
-    return new_node('=', lhs, new_node('^', lhs, assignment_expr()));
-  } else {
+  if (op == 0) {
     pos = prev_pos;
     return conditional_expr();
   }
+  if (op == '=')
+    return new_node('=', lhs, assignment_expr());
+  return new_opassign(op, lhs, assignment_expr());
+}
+
+// Consumes an assignment operator. Returns '=' for a simple assignment, the
+// binary operator for a compound assignment, or 0 if there is none.
+static int assignment_op() {
+  if (consume('='))
+    return '=';
+  if (consume(TK_ADD_EQ))
+    return '+';
+  if (consume(TK_SUB_EQ))
+    return '-';
+  if (consume(TK_MUL_EQ))
+    return '*';
+  if (consume(TK_DIV_EQ))
+    return '/';
+  if (consume(TK_SHL_EQ))
+    return ND_SHL;
+  if (consume(TK_SHR_EQ))
+    return ND_SHR;
+  if (consume(TK_BAND_EQ))
+    return '&';
+  if (consume(TK_BOR_EQ))
+    return '|';
+  if (consume(TK_XOR_EQ))
+    return '^';
+  return 0;
 }
 
 static Node *multiplicative_expr() {
@@ -311,7 +380,7 @@ static Type *decl_specifier() {
 }
 
 static Type *arr(Type *base, int len) {
-  Type *ty = malloc(sizeof(Type));
+  Type *ty = alloc(sizeof(Type));
   ty->ty = TY_ARR;
   ty->size = base->size * len;
   ty->align = base->align;
@@ -374,7 +443,7 @@ static Type *read_arr(Type *ty) {
 static Node *direct_declr(Type *ty) {
   if (peek(pos)->ty != TK_IDENT)
     bad_token(peek(pos), "Token is not identifier.");
-  char *name = peek(pos)->name;
+  char *name = alloc_str(peek(pos)->name);
   pos++;
 
   // Function parameters
@@ -386,13 +455,13 @@ static Node *direct_declr(Type *ty) {
       params = param_type_list();
       expect(')');
     }
-    Node *node = new_node(ND_FUNC, NULL, NULL);
+    Node *node = alloc_node(ND_FUNC);
     node->name = name;
     node->params = params;
     return node;
     // Variable definition
   } else {
-    Node *node = new_node(ND_IDENT, NULL, NULL);
+    Node *node = alloc_node(ND_IDENT);
     ty = read_arr(ty);
     node->var = new_var(ty, name);
     node->cty = node->var->ty;
@@ -417,8 +486,7 @@ static Node *initr(Node *ident) {
   Var *var = ident->var;
   Vector *inits = new_vec();
   if (consume('{')) {
-    Node *node = malloc(sizeof(Node));
-    node->ty = ND_INITS;
+    Node *node = alloc_node(ND_INITS);
     node->inits = inits;
     node->var = var;
 
@@ -436,7 +504,7 @@ static Node *initr(Node *ident) {
     }
     return node;
   }
-  Node *lhs = new_node_ident(var->name, var);
+  Node *lhs = new_node_ident(var);
   Node *rhs = assignment_expr();
   return new_node('=', lhs, rhs);
 }
@@ -459,21 +527,33 @@ static void *decl() {
   return node;
 }
 
+// True while parsing a switch body, except in the loops nested in it.
+static bool in_switch;
+// The switch whose body is about to be parsed.
+static Node *switch_body;
+
 static Node *jmp_stmt() {
   Node *node;
   if (consume(TK_RETURN)) {
-    node = new_node(ND_RETURN, NULL, NULL);
+    node = alloc_node(ND_RETURN);
     node->expr = expr();
     return node;
   }
-  bad_token(peek(pos), "Unknown jump statement");
+  Token *t = peek(pos);
+  if (consume(TK_BREAK)) {
+    if (!in_switch)
+      bad_token(t, "break is only supported in switch statements");
+    expect(';');
+    return alloc_node(ND_BREAK);
+  }
+  bad_token(t, "Unknown jump statement");
 }
 
 static Node *stmt();
 
 static Node *selection_stmt() {
   consume(TK_IF);
-  Node *node = new_node(ND_IF, NULL, NULL);
+  Node *node = alloc_node(ND_IF);
   expect('(');
   node->cond = expr();
   expect(')');
@@ -483,28 +563,116 @@ static Node *selection_stmt() {
   return node;
 }
 
+static Node *switch_stmt() {
+  expect(TK_SWITCH);
+  Node *node = alloc_node(ND_SWITCH);
+  expect('(');
+  node->cond = expr();
+  expect(')');
+  if (peek(pos)->ty != '{')
+    bad_token(peek(pos), "Expected the body of the switch");
+  bool outer = in_switch;
+  in_switch = true;
+  switch_body = node;
+  node->body = comp_stmt();
+  in_switch = outer;
+  return node;
+}
+
+// Evaluates a constant expression, such as a case value or the initializer
+// of a global.
+static int const_expr(Node *node) {
+  if (node->ty == ND_NUM)
+    return node->val;
+  int l, r;
+  switch (node->ty) {
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+  case '&':
+  case '|':
+  case '^':
+  case ND_SHL:
+    l = const_expr(node->lhs);
+    r = const_expr(node->rhs);
+    break;
+  default:
+    bad_token(peek(pos), "Expected a constant expression");
+  }
+  switch (node->ty) {
+  case '+':
+    return l + r;
+  case '-':
+    return l - r;
+  case '*':
+    return l * r;
+  case '/':
+    if (r == 0)
+      bad_token(peek(pos), "Division by zero in a constant expression");
+    return l / r;
+  case '&':
+    return l & r;
+  case '|':
+    return l | r;
+  case '^':
+    return l ^ r;
+  default:
+    return l << r;
+  }
+}
+
+// Parses a case or default label of a switch body whose statements so far
+// are stmts.
+static Node *case_label(Vector *stmts) {
+  Token *t = peek(pos);
+  Node *node = alloc_node(ND_CASE);
+  if (!consume(TK_DEFAULT)) {
+    expect(TK_CASE);
+    node->cond = new_node_num(const_expr(conditional_expr()));
+  }
+  expect(':');
+  for (int i = 0; i < stmts->len; i++) {
+    Node *s = stmts->data[i];
+    if (s->ty != ND_CASE || (s->cond == NULL) != (node->cond == NULL))
+      continue;
+    if (s->cond == NULL || s->cond->val == node->cond->val)
+      bad_token(t, "Duplicate case label");
+  }
+  return node;
+}
+
+// Parses the body of a loop, where break is not supported.
+static Node *loop_body() {
+  bool outer = in_switch;
+  in_switch = false;
+  loop_depth++;
+  Node *node = stmt();
+  loop_depth--;
+  in_switch = outer;
+  return node;
+}
+
 static Node *iter_stmt() {
   if (consume(TK_FOR)) {
-    Node *node = malloc(sizeof(Node));
-    node->ty = ND_FOR;
+    Node *node = alloc_node(ND_FOR);
     expect('(');
-    scope = new_scope(scope);
+    enter_scope();
     node->init = expr();
     expect(';');
     node->cond = expr();
     expect(';');
     node->after = expr();
     expect(')');
-    node->body = stmt();
-    scope = scope->outer;
+    node->body = loop_body();
+    leave_scope();
     return node;
   } else if (consume(TK_WHILE)) {
-    Node *node = malloc(sizeof(Node));
-    node->ty = ND_WHILE;
+    Node *node = alloc_node(ND_WHILE);
     expect('(');
     node->cond = expr();
     expect(')');
-    node->body = stmt();
+    node->body = loop_body();
     return node;
   }
   return &node_null;
@@ -512,8 +680,12 @@ static Node *iter_stmt() {
 
 static Node *stmt() {
   int ty = peek(pos)->ty;
-  if (ty == TK_RETURN) {
+  if (ty == TK_RETURN || ty == TK_BREAK) {
     return jmp_stmt();
+  } else if (ty == TK_CASE || ty == TK_DEFAULT) {
+    bad_token(peek(pos), "Case labels must be statements of a switch body");
+  } else if (ty == TK_SWITCH) {
+    return switch_stmt();
   } else if (ty == '{') {
     return comp_stmt();
   } else if (ty == TK_IF) {
@@ -528,17 +700,22 @@ static Node *stmt() {
 }
 
 static Node *comp_stmt() {
+  Node *sw = switch_body;
+  switch_body = NULL;
   expect('{');
-  scope = new_scope(scope);
-  Node *node = new_node(ND_COMP_STMT, NULL, NULL);
+  enter_scope();
+  Node *node = alloc_node(ND_COMP_STMT);
   node->stmts = new_vec();
   while (!consume('}')) {
-    if (istypename())
+    int ty = peek(pos)->ty;
+    if (sw && (ty == TK_CASE || ty == TK_DEFAULT))
+      vec_push(node->stmts, case_label(node->stmts));
+    else if (istypename())
       vec_push(node->stmts, decl());
     else
       vec_push(node->stmts, stmt());
   }
-  scope = scope->outer;
+  leave_scope();
   return node;
 }
 
@@ -554,13 +731,161 @@ static Node *func_def() {
   return node;
 }
 
+// Parses a function definition starting at the given position.
+static Node *top_func(int start) {
+  pos = start;
+  // Everything allocated for a function passed to the handler is released
+  // once the handler returns.
+  if (func_handler)
+    arena_begin();
+  enter_scope();
+  Node *func = func_def();
+  leave_scope();
+  return func;
+}
+
+// Passes the function to the function handler if there is one. Returns the
+// function, or NULL if it has been handled.
+static Node *finish_func(Node *func) {
+  if (func_handler) {
+    func_handler(func);
+    arena_end();
+    return NULL;
+  }
+  return func;
+}
+
+// Returns true if the declaration at the current position is of a global
+// variable rather than a function.
+static bool at_global_decl() {
+  int p = pos + 1;
+  while (peek(p)->ty == '*')
+    p++;
+  return peek(p)->ty == TK_IDENT && peek(p + 1)->ty != '(';
+}
+
+// Parses the declaration of a global variable. Its initializer is a
+// constant or a list of constants, which are kept in the variable.
+static void global_decl() {
+  Type *ty = decl_specifier();
+  Var *var = declr(ty)->var;
+  if (consume('=')) {
+    var->init = new_vec();
+    if (consume('{')) {
+      do {
+        vec_push(var->init, (void *)(intptr_t)const_expr(assignment_expr()));
+      } while (consume(','));
+      expect('}');
+      if (var->ty->ty == TY_ARR && var->ty->len == -1)
+        resize_arr(var->ty, var->init->len);
+    } else {
+      vec_push(var->init, (void *)(intptr_t)const_expr(assignment_expr()));
+    }
+  }
+  if (var->ty->ty == TY_ARR && var->ty->len == -1)
+    bad_token(peek(pos), format("Array size of %s is unknown", var->name));
+  expect(';');
+}
+
 static Node *root() {
-  Node *node = new_node(ND_ROOT, NULL, NULL);
+  Node *node = alloc_node(ND_ROOT);
   node->funcs = new_vec();
+  node->globals = globals;
   while (peek(pos)->ty != TK_EOF) {
-    scope = new_scope(scope);
-    vec_push(node->funcs, func_def());
-    scope = scope->outer;
+    if (at_global_decl()) {
+      global_decl();
+      continue;
+    }
+    Node *func = finish_func(top_func(pos));
+    if (func)
+      vec_push(node->funcs, func);
+  }
+  return node;
+}
+
+// A function definition whose body has been skipped.
+typedef struct {
+  int start; // position of the first token of the definition
+  bool reached;
+  Node *func;
+} Skimmed;
+
+// Skips a function definition and returns its name.
+static char *skim_func() {
+  decl_specifier();
+  while (consume('*'))
+    ;
+  Token *t = peek(pos);
+  if (t->ty != TK_IDENT)
+    bad_token(t, "Token is not identifier.");
+  while (!consume('{')) {
+    if (peek(pos)->ty == TK_EOF)
+      bad_token(peek(pos), "Expected function body");
+    pos++;
+  }
+  for (int depth = 1; depth > 0; pos++) {
+    if (peek(pos)->ty == TK_EOF)
+      bad_token(peek(pos), "Unclosed function body");
+    if (peek(pos)->ty == '{')
+      depth++;
+    else if (peek(pos)->ty == '}')
+      depth--;
+  }
+  return t->name;
+}
+
+static void reach(Skimmed *s, Vector *worklist) {
+  if (s == NULL || s->reached)
+    return;
+  s->reached = true;
+  vec_push(worklist, s);
+}
+
+// Parses only the functions reachable from main by calls. Function bodies
+// are skipped first, and then parsed on demand starting from main. Only main
+// is global in the output, so other functions that are not called from it
+// are dead. Without main, every function is a root.
+static Node *root_skim() {
+  Map *funcs = new_map();
+  while (peek(pos)->ty != TK_EOF) {
+    if (at_global_decl()) {
+      global_decl();
+      continue;
+    }
+    Skimmed *s = alloc(sizeof(Skimmed));
+    s->start = pos;
+    map_set(funcs, skim_func(), s);
+  }
+
+  Vector *worklist = new_vec();
+  if (map_get(funcs, "main")) {
+    reach(map_get(funcs, "main"), worklist);
+  } else {
+    for (int i = 0; i < funcs->vals->len; i++)
+      reach(funcs->vals->data[i], worklist);
+  }
+
+  Vector *calls = new_vec();
+  while (worklist->len > 0) {
+    Skimmed *s = vec_pop(worklist);
+    Node *func = top_func(s->start);
+    calls->len = 0;
+    collect_calls(func, calls);
+    for (int i = 0; i < calls->len; i++) {
+      Node *call = calls->data[i];
+      reach(map_get(funcs, call->name), worklist);
+    }
+    s->func = finish_func(func);
+  }
+
+  // Emit the functions in the source order.
+  Node *node = alloc_node(ND_ROOT);
+  node->funcs = new_vec();
+  node->globals = globals;
+  for (int i = 0; i < funcs->vals->len; i++) {
+    Skimmed *s = funcs->vals->data[i];
+    if (s->func)
+      vec_push(node->funcs, s->func);
   }
   return node;
 }
@@ -569,7 +894,21 @@ Node *parse(Vector *_tokens) {
   tokens = _tokens;
 
   Node *node;
-  scope = new_scope(NULL);
+  undo_log = new_vec();
+  scope_starts = new_vec();
+  globals = new_vec();
+  node = skim_funcs ? root_skim() : root();
+  return node;
+}
+
+Node *parse_stream(TokenStream *ts) {
+  stream = ts;
+
+  Node *node;
+  undo_log = new_vec();
+  scope_starts = new_vec();
+  globals = new_vec();
   node = root();
+  stream = NULL;
   return node;
 }
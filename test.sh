@@ -3,7 +3,7 @@
 test_() {
     expected="$1"
     input="$2"
-    ./mdcc -e "$input" > tmp.s
+    ./mdcc $MDCC_FLAGS -e "$input" > tmp.s
     gcc -arch x86_64 -o tmp tmp.s
     ./tmp
     actual="$?"
@@ -16,6 +16,10 @@ test_() {
 }
 NL=$'\n'
 
+test_flags() {
+    MDCC_FLAGS="$1" test_ "$2" "$3"
+}
+
 test_ 1 "int main() { return 1;}"
 test_ 3 "int main() {return 1 + 2;}"
 test_ 6 "int main() { return 3 * 2;}"
@@ -101,5 +105,178 @@ test_ 1 "int main() { int a = /** a =** 2;/* **/1; return a; }"
 test_ 1 "int main() { int a = 1; // a = 2;${NL} return a; }"
 test_ 6 "int main() { int a[3] = {1, 2, 3}; return a[0]+a[1]+a[2]; }"
 test_ 6 "int main() { int a[] = {1, 2, 3}; return a[0]+a[1]+a[2]; }"
+test_flags -flazy-lex 3 "int z() { return 1; } int main() { int a = 1; a += z() + 1; return a; }"
+test_flags -fstream 44 "int sum(int a, int b, int c, int d, int e, int f) { return a*b + c*d + e*f; } int main() { return sum(1, 2, 3, 4, 5, 6); }"
+test_flags "-fstream -flazy-lex" 6 "int f(int a[2]) { return a[0] + a[1]; } int main() { int a[] = {2, 4}; return f(a); }"
+test_flags -fskim 3 "int dead(int a) { return a; } int one() { return 1; } int two() { return one() + one(); } int main() { return one() + two(); }"
+test_flags "-fskim -fstream" 3 "int dead(int a) { return a; } int one() { return 1; } int two() { return one() + one(); } int main() { return two() + one(); }"
+test_ 5 "int dead(int a) { return dead(a); } int two() { return 2; } int three() { return two() + 1; } int main() { return two() + three(); }"
+test_flags -fcold-section 9 "int die(int c) { exit(c); return 0; } int check(int a) { if (a > 5) { die(a); } return a; } int main() { return check(3) + check(9); }"
+test_ 5 "int f(int a) { if (a > 2) return 1; return 0; } int main() { return f(3) + f(1) * 2 + f(5) * 4; }"
+test_ 14 "int g(int a) { a + 1; a = a * 2; return a; } int main() { int x = 3; return g(x) + g(x + 1); }"
+test_ 13 "int h(int x) { int y = x * 2; return y + 1; } int main() { int y = 4; return h(y) + y; }"
+test_ 9 "int h(int x) { int y = x * 2; return y + 1; } int main() { return h(h(1)) + 2 * h(h(0) - 1) + h(0) - 1; }"
+test_flags -fno-inline 13 "int h(int x) { int y = x * 2; return y + 1; } int main() { int y = 4; return h(y) + y; }"
+test_flags -finline-report 4 "int z() { return 1; } int f(int a[2]) { return a[0] + a[1]; } int main() { int a[] = {1, 2}; return z() + f(a); }"
+test_ 1 "int main() { int a = 0; if (a == 0) a = 1; else a = 2; return a; }"
+test_ 2 "int main() { if (0) { return 1; } else { return 2; } return 3; }"
+test_ 192 "int main() { int i; int s = 0; for (i = 0; i < 3000000; i++) s = s + 1; return s & 255; }"
+test_ 5 "int main() { int a = 1; int b = 2; b = 3; a + (a = 5); while (0) a = 7; return a; }"
+test_ 2 "int main() { int a = 1; 2 * a++; int b = a * 3; return a; }"
+test_ 4 "int main() { int a = 1; for (;;) { a = a * 2; if (a > 3) return a; } }"
+test_ 1 "int main() { int a[2]; a[0] = 300; a[1] = 5; return a[0] == 300; }"
+test_ 12 "int main() { int a[10]; int i; int n = 10; int k = 3; for (i = 0; i < n; i++) a[i] = i; for (i = 0; i < n; i++) a[i] = a[i] + k; return a[9]; }"
+test_ 45 "int main() { int a[10]; int i; int s = 0; for (i = 0; i < 10; i = i + 1) a[i] = i; for (i = 9; i > 0; i--) s = s + a[i]; return s + a[0]; }"
+test_ 66 "int main() { int a[3][4]; int i; int j; int s = 0; for (i = 0; i < 3; i++) for (j = 0; j < 4; j = j + 1) a[i][j] = i * 4 + j; for (i = 0; i < 3; i++) for (j = 3; j > 0 - 1; j = j - 1) s = s + a[i][j]; return s; }"
+test_ 60 "int main() { int i; int s = 0; int n = 5; int k = 2; for (i = 0; i < n * k; i++) s = s + k * 3; return s; }"
+test_ 12 "int main() { int i; int s = 0; int x = 1; int *p = &x; for (i = 0; i < 3; i++) { s = s + x * 2; *p = *p + 1; } return s; }"
+test_ 6 "int main() { char c[4]; int i; for (i = 0; i < 4; i++) c[i] = i; return c[1] + c[2] + c[3]; }"
+test_flags -fno-loop-opt 12 "int main() { int a[10]; int i; int n = 10; int k = 3; for (i = 0; i < n; i++) a[i] = i; for (i = 0; i < n; i++) a[i] = a[i] + k; return a[9]; }"
+test_ 6 "int main() { int a = 3; int s = 0; while (a != 0) { s = s + a; a = a - 1; } return s; }"
+test_flags -funroll=4 45 "int main() { int i; int s = 0; int n = 10; for (i = 0; i < n; i++) s = s + i; return s; }"
+test_flags -funroll=4 3 "int main() { int i; int s = 0; for (i = 0; i < 3; i++) s = s + 1; return s; }"
+test_flags -funroll=3 30 "int main() { int a[10]; int i; int s = 0; for (i = 0; i < 10; i++) a[i] = i; for (i = 9; i > 0; i = i - 2) s = s + a[i] + 1; return s; }"
+test_flags -funroll=8 7 "int main() { int i; for (i = 0; i < 100; i++) { if (i == 7) { return i; } } return 0; }"
+test_flags "-fno-inline -funroll=4" 0 "int count(int s, int n) { int c = 0; int i; for (i = s; i < n; i++) { c++; if (c > 100) return 99; } return c; } int main() { return count(0 - 2147483647 + 10, 0 - 2147483647); }"
+test_flags "-fno-inline -funroll=4" 51 "int count(int s, int n) { int c = 0; int i; for (i = s; i > n; i = i - 2) { c++; if (c > 100) return 99; } return c; } int main() { return count(2147483647, 2147483647 - 1) + count(9, 0) * 10; }"
+test_flags -funroll=4 8 "int main() { long i; long s = 0; long n = 4; for (i = 0; i < n; i++) s = s + i; for (i = 0; i < 1; i++) s = s + 1; return s + (n > 3); }"
+test_ 5 "int main() { int x = 1; int y; if (x == 1) { y = 5; } else { y = 7; } return y; }"
+test_ 43 "int f(int a) { int x = 3; if (a > 1) { x = 4; } return x; } int main() { return f(2) * 10 + f(0); }"
+test_ 2 "int main() { int x = 1; int *p = &x; *p = 2; return x; }"
+test_ 4 "int main() { char c = 250; c = c + 10; return c; }"
+test_ 10 "int main() { int x = 0; int i; for (i = 0; i < 5; i++) { x = x + 2; } return x; }"
+test_ 55 "int fib(int n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); } int main() { return fib(10); }"
+test_ 44 "int main() { char c = 0; int i; for (i = 0; i < 300; i++) c++; return c; }"
+test_flags -fno-inline 15 "int g(int a) { return a + 1; } int main() { int i; int s = 0; for (i = 0; i < 5; i++) s = s + g(i); return s; }"
+test_flags -fno-regalloc 55 "int fib(int n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); } int main() { return fib(10); }"
+test_ 111 "int main() { int a[3]; int i = 0; a[0] = 1; a[1] = 2; a[i++] += 10; return a[0] * 10 + i; }"
+test_ 3 "int main() { int a[2]; a[1] = 2; ++a[1]; --a[1]; ++a[1]; return a[1]; }"
+test_ 4 "int main() { char c[2]; c[0] = 250; c[0] += 10; return c[0]; }"
+test_ 7 "int main() { int a[4]; int *q[2]; q[0] = a; q[0] += 2; *q[0] = 7; return a[2]; }"
+test_ 55 "int main() { int a[4]; a[1] = 100; a[1] /= 7; a[1] <<= 2; a[1] -= 1; return a[1]; }"
+test_ 47 "int main() { int a[2]; a[0] = 3; a[1] = 4; int i = a[0]; int j = a[1]; int x = i * j + 1; int y = i * j + 2; i = 5; int z = i * j; return x + y + z; }"
+test_ 13 "int main() { int a[1]; a[0] = 2; int i = a[0]; int x = i * i; i++; int y = i * i; return x + y; }"
+test_ 26 "int f(int a, int b) { int s = a * b; if (a * b > 10) { return s + a * b; } return a * b; } int main() { return f(3, 4) + f(1, 2); }"
+test_flags -fno-cse 47 "int main() { int a[2]; a[0] = 3; a[1] = 4; int i = a[0]; int j = a[1]; int x = i * j + 1; int y = i * j + 2; i = 5; int z = i * j; return x + y + z; }"
+test_ 6 "int main() { int a[4]; int *p = a; *(p + 2) = 5; p = p + 3; *(p - 1) = *(p - 1) + 1; return a[2]; }"
+test_ 16 "int main() { char s[4]; int i = 2; s[i] = 7; s[i + 1] = 9; return s[i] + s[3]; }"
+test_ 15 "int main() { int a[4]; int i; for (i = 0; i < 4; i++) a[i] = i * 3; int *p = &a[2]; return *p + a[i - 1]; }"
+test_ 7 "int main() { int x = 3; int y = 4; int *p[2]; p[0] = &x; p[1] = &y; return *p[0] + *p[1]; }"
+test_ 6 "int f(int a[4], int i) { a[i] += 5; return a[i]; } int main() { int a[4]; a[2] = 1; return f(a, 2); }"
+test_ 9 "int main() { int a[2]; int b[3]; a[0] = 2; a[1] = 1; b[2] = 9; return b[a[0]]; }"
+test_ 1 "int main() { char c = 200; return c < 0; }"
+test_ 1 "int main() { char a[2]; a[0] = 0 - 1; return a[0] + 2; }"
+test_ 1 "int main() { char c = 127; c++; return c == 0 - 128; }"
+test_ 2 "int main() { char s[3]; s[0] = 1; s[1] = 2; s[2] = 0; int n = 0; while (s[n] != 0) n++; return n; }"
+test_ 50 "int main() { char a[2]; a[0] = 100; a[1] = 100; int x = a[0] + a[1]; return x / 4 + a[0] * 0; }"
+test_ 7 "int main() { int a[1]; a[0] = 0 - 7; int x = a[0]; return x / 2 + 10; }"
+test_ 9 "int main() { int a[1]; a[0] = 0 - 7; int x = a[0]; return x % 2 + 10; }"
+test_ 6 "int main() { int a[1]; a[0] = 0 - 100; int x = a[0]; return x / 7 + 20; }"
+test_ 18 "int main() { int a[1]; a[0] = 0 - 100; int x = a[0]; return x % 7 + 20; }"
+test_ 1 "int main() { int a[1]; a[0] = 0 - 7; int x = a[0]; return x / (0 - 4); }"
+test_ 1 "int main() { int a[2]; a[0] = 0 - 7; a[1] = 2; return a[0] / a[1] == 0 - 3; }"
+test_ 1 "int main() { int a[2]; a[0] = 0 - 7; a[1] = 2; return a[0] % a[1] == 0 - 1; }"
+test_ 1 "int main() { return (0 - 7) / 2 == 0 - 3; }"
+test_ 1 "int main() { long a[1]; a[0] = 0 - 1000; long x = a[0]; return x / 3 == 0 - 333; }"
+test_ 1 "int main() { int a[1]; a[0] = 0 - 9; a[0] /= 3; return a[0] % 2 == 0 - 1; }"
+test_ 0 "int main() { int a[3]; a[0] = 7; a[1] = 0 - 6; a[2] = 8; int bad = 0; int n; for (n = 0 - 1000; n < 1000; n++) { if (n / 7 != n / a[0]) bad++; if (n % 7 != n % a[0]) bad++; if (n / (0 - 6) != n / a[1]) bad++; if (n % (0 - 6) != n % a[1]) bad++; if (n / 8 != n / a[2]) bad++; if (n % 8 != n % a[2]) bad++; } return bad; }"
+test_ 36 "int f(int a, int b, int c, int d, int e, int g, int h, int i) { return a + b + c + d + e + g + h + i; } int main() { return f(1, 2, 3, 4, 5, 6, 7, 8); }"
+test_flags -fno-inline 88 "int f(int a, int b, int c, int d, int e, int g, int h, int i) { return i * 10 + h + a; } int main() { return f(1, 2, 3, 4, 5, 6, 7, 8); }"
+test_flags -fno-inline 45 "int f(int a, int b, int c, int d, int e, int g, char h, int i) { int s = 0; int k; for (k = 0; k < i; k++) s = s + k; return s + h * 0; } int main() { return f(1, 2, 3, 4, 5, 6, 7, 10); }"
+test_flags -fno-inline 52 "int g(int x) { return x * 2; } int f(int a, int b, int c, int d, int e, int g, int h, int i, int j) { return a + b + c + d + e + g + h + i + j; } int main() { int x = 3; return 1 + f(g(1), x, g(x), 4, x + 1, 6, g(3), x, g(g(4)) + 1); }"
+test_flags -fno-inline 55 "int f(int n, int a, int b, int c, int d, int e, int g) { if (n == 0) return g; return f(n - 1, a, b, c, d, e, g + n); } int main() { return f(10, 0, 0, 0, 0, 0, 0); }"
+test_flags -fstream 10 "int f(int n, int a, int b, int c, int d, int e, int g) { if (n == 0) return g; return f(n - 1, a, b, c, d, e, g + 1); } int main() { int a[1]; a[0] = 4; return a[0] + f(6, a[0], 0, 0, 0, 0, 0); }"
+test_flags -fno-inline 25 "int sq(int a) { return a * a; } int main() { return sq(3) + sq(4); }"
+test_flags -fno-inline 7 "int one() { return 1; } int main() { int a = 3; return one() + a * 2; }"
+test_ 45 "int clamp(int a) { if (a > 5) return 5; return a; } int main() { int s = 0; int i; for (i = 0; i < 10; i++) s = s + (1 + clamp(i)); return s; }"
+test_flags -fno-omit-frame-pointer 45 "int clamp(int a) { if (a > 5) return 5; return a; } int main() { int s = 0; int i; for (i = 0; i < 10; i++) s = s + (1 + clamp(i)); return s; }"
+test_flags -fno-inline 6 "int f(int n) { int s = 0; int i; for (i = 0; i < n; i++) s = s + i; return s; } int main() { return f(4); }"
+test_ 1 "int main() { char a = 255; a += 2; return 1; }"
+test_ 4 "int main() { char a = 255; int b = 1; for (;;) { b = b * 2; if (b > 3) return b; } }"
+test_ 2 "int even(int n) { if (n == 0) return 1; return odd(n - 1); } int odd(int n) { if (n == 0) return 0; return even(n - 1); } int main() { return even(1000000) + odd(7); }"
+test_ 64 "int count(int n, int acc) { if (n == 0) return acc; return count(n - 1, acc + 1); } int main() { return count(1000000, 0) % 256; }"
+test_ 1 "int f(int n, int *p) { if (n == 0) return *p; return f(n - 1, &n); } int main() { int a = 5; return f(3, &a); }"
+test_ 6 "int f(int n, int *p) { int a[2]; a[0] = n; if (n == 0) return *p; return f(n - 1, a); } int main() { int a[1]; a[0] = 5; return f(3, a) + f(0, a); }"
+test_flags -fno-tail-calls 232 "int count(int n, int acc) { if (n == 0) return acc; return count(n - 1, acc + 1); } int main() { return count(1000, 0) % 256; }"
+
+test_ 42 "int f(int x) { switch (x) { case 0: return 10; case 1: return 11; case 2: return 12; case 3: return 13; case 5: return 15; case 6: return 16; default: return 1; } } int main() { return f(0) + f(4) + f(6) + f(7) + f(0 - 1) + f(3); }"
+test_flags -fno-jump-tables 42 "int f(int x) { switch (x) { case 0: return 10; case 1: return 11; case 2: return 12; case 3: return 13; case 5: return 15; case 6: return 16; default: return 1; } } int main() { return f(0) + f(4) + f(6) + f(7) + f(0 - 1) + f(3); }"
+test_ 33 "int f(int x) { int r = 0; switch (x) { case 1: r = 1; break; case 10: r = 2; break; case 100: r = 3; break; case 1000: r = 4; break; case 10000: r = 5; break; case 100000: r = 6; break; case 7: r = 7; case 8: r = r + 8; break; } return r; } int main() { return f(7) + f(100000) + f(5) + f(1) + f(8) + f(100); }"
+test_ 117 "int f(int x) { int s = 0; switch (x) { case 1: s = s + 1; case 2: s = s + 2; case 3: s = s + 4; break; default: s = 100; } return s; } int main() { return f(1) + f(2) + f(3) + f(9); }"
+test_ 42 "int f(int x, int y) { switch (x) { case 1: switch (y) { case 1: return 11; case 2: return 12; } return 10; case 2: return 20; } return 0; } int main() { return f(1, 2) + f(1, 3) + f(2, 1) + f(5, 1); }"
+test_ 118 "int main() { int s = 0; int i; for (i = 0; i < 16; i++) { switch (i & 7) { case 0: s = s + 1; break; case 1: s = s + 2; break; case 2: s = s + 3; break; case 3: s = s + 4; break; case 4: s = s + 5; break; default: s = s + 100; } } return s - 512; }"
+test_ 3 "int main() { char c = 99; switch (c) { case 'a': return 1; case 'b': return 2; case 'c': return 3; case 'd': return 4; case 'e': return 5; } return 0; }"
+test_ 5 "int main() { int k = 3; int r = 1; switch (k) { case 1: r = 2; break; case 3: r = r + 4; } return r; }"
+test_flags -fstream 4 "long f(long v) { switch (v) { case 0: return 1; case 1: return 2; case 2: return 3; case 3: return 4; case 4: return 5; } return 0; } int main() { return f(3) + f(7); }"
+test_ 62 "int f() { int a[40] = {1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,33,34,35}; int s = 0; int i; for (i = 0; i < 40; i++) s = s + a[i] * (i + 1); return s; } int g() { int d[64]; int i; for (i = 0; i < 64; i++) d[i] = i; return d[5]; } int main() { g(); return f() % 256; }"
+test_ 237 "int f(int x) { int a[36] = {1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,x,x * 2,35}; int s = 0; int i; for (i = 0; i < 36; i++) s = s + a[i] * (i + 1); return s; } int main() { return f(100) % 256; }"
+test_ 7 "int main() { int junk[100]; int i; for (i = 0; i < 100; i++) junk[i] = 77; int k = junk[0] - 72; int a[100] = {k, 2}; int s = 0; for (i = 0; i < 100; i++) s = s + a[i]; return s; }"
+test_ 249 "int main() { int junk[60]; int i; for (i = 0; i < 60; i++) junk[i] = 7; char c[200] = {1, 200, 0 - 1, 300, 5}; int s = 0; for (i = 0; i < 200; i++) s = s + c[i]; return s + junk[1] * 0; }"
+test_ 9 "int main() { int junk[5]; junk[1] = 3; junk[4] = 3; int a[5] = {9}; return a[0] + a[1] + a[2] + a[3] + a[4] + junk[1] * 0; }"
+test_ 23 "int g; int a[5] = {1, 2, 3}; char c[] = {1, 2, 300}; long l = 70000 * 3; int *p; int bump(int x) { g = g + x; return g; } int sum() { int s = 0; int i; for (i = 0; i < 5; i++) s = s + a[i]; return s; } int main() { bump(3); bump(4); a[4] = 10; p = &g; *p = *p + 1; return g + sum() + c[2] + c[0] + l / 1000; }"
+test_ 43 "int n; int t[8] = {5, 6, 7}; char s[4]; int inc() { n++; return n; } int main() { int i; int k = 0; for (n = 0; n < 6; n++) { k = k + inc(); } for (i = 0; i < 7; i++) { t[i + 1] += t[i]; s[i & 3] = i; } n += 2; return k + t[7] + s[1] + s[3] + n; }"
+test_ 7 "int g = 5; int main() { int g = 2; { g = g + 1; } return g + 4; }"
+test_ 12 "int g = 5; int set(int v) { g = v; return 0; } int main() { g = 1; set(7); return g + 5; }"
+test_flags -fstream 23 "int g; int a[5] = {1, 2, 3}; char c[] = {1, 2, 300}; long l = 70000 * 3; int *p; int bump(int x) { g = g + x; return g; } int sum() { int s = 0; int i; for (i = 0; i < 5; i++) s = s + a[i]; return s; } int main() { bump(3); bump(4); a[4] = 10; p = &g; *p = *p + 1; return g + sum() + c[2] + c[0] + l / 1000; }"
+test_flags -fskim 43 "int n; int t[8] = {5, 6, 7}; char s[4]; int inc() { n++; return n; } int main() { int i; int k = 0; for (n = 0; n < 6; n++) { k = k + inc(); } for (i = 0; i < 7; i++) { t[i + 1] += t[i]; s[i & 3] = i; } n += 2; return k + t[7] + s[1] + s[3] + n; }"
+test_ 7 "int *g; int save(int *p) { g = p; return 0; } int main() { { int a[4]; a[1] = 7; save(a); { int b[4]; b[1] = 9; b[2] = b[1]; } return g[1]; } }"
+test_ 14 "int main() { int s; { int a[4]; int *p = a; p[0] = 5; { int b[4]; b[0] = 9; b[1] = b[0]; s = b[1]; } return p[0] + s; } }"
+test_flags -fno-regalloc 13 "int main() { int s = 0; int i; int t; for (i = 0; i < 3; i++) { { int a[2]; a[0] = i; a[1] = 0; s = s + a[0] + a[1]; } if (i > 0) s = s + t; t = 10 * i; } return s; }"
+test_ 75 "int main() { int s = 0; int i; int j; for (i = 0; i < 4; i++) { int k; int m[3]; for (j = 0; j < 3; j++) { int q[2]; q[0] = j; q[1] = i; if (j > 0) k = k + q[0] * q[1]; else k = 1; m[j] = k; } s = s + m[0] + m[1] + m[2]; } { char c[40]; for (i = 0; i < 40; i++) c[i] = i; s = s + c[39]; } return s; }"
+test_flags -fno-stack-coloring 75 "int main() { int s = 0; int i; int j; for (i = 0; i < 4; i++) { int k; int m[3]; for (j = 0; j < 3; j++) { int q[2]; q[0] = j; q[1] = i; if (j > 0) k = k + q[0] * q[1]; else k = 1; m[j] = k; } s = s + m[0] + m[1] + m[2]; } { char c[40]; for (i = 0; i < 40; i++) c[i] = i; s = s + c[39]; } return s; }"
+test_ 154 "int main() { int a[37]; int b[37]; int c[37]; int i; int s = 0; for (i = 0; i < 37; i++) { a[i] = i; b[i] = 3 * i; } for (i = 0; i < 37; i++) c[i] = a[i] + b[i]; for (i = 0; i < 37; i++) s = s + c[i]; return s / 10 + c[36]; }"
+test_ 243 "int main() { char s[45]; char t[45]; int i; int k = 90; int h = 0; for (i = 0; i < 45; i++) s[i] = i * 7; for (i = 0; i < 45; i++) t[i] = (s[i] ^ k) + 3; for (i = 0; i < 45; i++) h = h + t[i]; return h & 255; }"
+test_ 150 "int shift(int *d, int *s, int n) { int i; for (i = 0; i < n; i++) d[i] = s[i] + 1; return 0; } int main() { int a[20]; int i; for (i = 0; i < 20; i++) a[i] = i * i; shift(a + 1, a, 18); shift(a, a + 8, 10); return a[0] + a[9] + a[18] + a[19]; }"
+test_ 70 "long a[300]; long b[300]; int main() { int i; long s = 0; for (i = 0; i < 300; i++) b[i] = i; for (i = 1; i < 299; i++) a[i] = (b[i] << 2) | 1; for (i = 0; i < 300; i++) s = s + a[i]; return s & 255; }"
+test_flags -fno-vectorize 150 "int shift(int *d, int *s, int n) { int i; for (i = 0; i < n; i++) d[i] = s[i] + 1; return 0; } int main() { int a[20]; int i; for (i = 0; i < 20; i++) a[i] = i * i; shift(a + 1, a, 18); shift(a, a + 8, 10); return a[0] + a[9] + a[18] + a[19]; }"
+test_ 250 "int h(int x){return x;} int f(int p0,int p1,int p2,int p3,int p4,int p5,int p6,int p7){return h(p1)+p6;} int main(){int i; int a[10]; int g[8]; int s=0; for(i=0;i<10;i++)a[i]=i; for(i=0;i<8;i++)g[i]=i*7+3; i=0; while(i<8){s=s+f(0,a[g[i]%10],0,0,0,0,g[i],0); i=i+1;} return s;}"
+test_ 142 "int id(int x) { return x; } int f(int a, int b, int c, int d, int e, int g, int h, int k) { return id(a) * 3 + h * 2 + k - b; } int main() { int v[3]; int x; int y; int z; v[0] = 4; v[1] = 5; v[2] = 6; x = v[0]; y = v[1]; z = v[2]; return f(x * y + z, 1, 2, 3, 4, 5, x * y + z, (x * y + z) / 2); }"
+test_ 1 "int main() { long x; x = 2147483647; x++; if (x > 0) return 1; return 2; }"
+test_ 1 "int main() { long x; x = 0 - 2147483647; x--; x--; if (x < 0) return 1; return 2; }"
+test_ 1 "int main() { int a[1]; long x; a[0] = 0 - 1; x = a[0]; return x < 0; }"
+test_ 1 "int id(int x) { return x; } int wide(int p) { long x; x = p; id(0); if (x < 0) return 1; return 2; } int main() { return wide(0 - 5); }"
+test_ 7 "int main() { int a[3]; long s; int *p; a[0] = 0 - 7; a[1] = 3; s = 10; s = s + a[0]; s += a[0]; p = a + 2; p = p + a[0] + 6; if (s < 0) return *p - s; return 99; }"
+test_ 112 "int get(int *p, int i) { return p[i]; } int main() { int a[5]; int i; int s = 0; int *p; char c[4]; char k; for (i = 0; i < 5; i++) a[i] = i * 10; for (i = 0; i < 4; i++) c[i] = i + 1; p = a + 4; k = 0 - 2; for (i = 0 - 3; i < 1; i++) s = s + p[i]; return s + get(a + 2, 0 - 1) + (c + 3)[k]; }"
+test_flags -fno-inline 112 "int get(int *p, int i) { return p[i]; } int main() { int a[5]; int i; int s = 0; int *p; char c[4]; char k; for (i = 0; i < 5; i++) a[i] = i * 10; for (i = 0; i < 4; i++) c[i] = i + 1; p = a + 4; k = 0 - 2; for (i = 0 - 3; i < 1; i++) s = s + p[i]; return s + get(a + 2, 0 - 1) + (c + 3)[k]; }"
+test_flags -fcold-section 4 "int g; int check(int a) { if (a < 1000) return a; exit(1); } int main() { g = 3; if (g > 1) { check(g); g = g + 1; } return g; }"
+test_ 150 "int f(int x) { switch (x) { case 0 - 1: return 10; case 2 * 3: return 20; case 0 - 100: return 30; case 1 << 4: return 40; default: return 50; } } int main() { return f(0 - 1) + f(6) + f(0 - 100) + f(16) + f(7); }"
+test_flags -fno-inline 109 "int f(int x) { switch (x) { case 0 - 2: return 1; case 0 - 1: return 2; case 0: return 3; case 1: return 4; case 2: return 5; case 3: return 6; } return 9; } int main() { return f(0 - 2) * 10 + f(0 - 1) + f(3) * 100 + f(0 - 3); }"
+
+# Compares n / d and n % d for constant divisors against the same division
+# by id(d), which goes through idiv. Returns the number of the first check
+# that differs.
+divs=(1 "(0 - 1)" 2 "(0 - 2)" 8 "(0 - 16)" 1024 "(0 - 65536)" 1073741824
+      "((0 - 2147483647) - 1)" 2147483647 "(0 - 2147483647)" 2147483645 3
+      "(0 - 7)" 10 1000 641 65537 1000003 "(0 - 1000003)" 1000000007 2147483629
+      "(0 - 2147483629)")
+div_checks() {
+    k=$1
+    for d in "${divs[@]}"; do
+        check="if (n / $d != n / id($d)) return $k; if (n % $d != n % id($d)) return $((k + 1));"
+        if [ "$d" == "(0 - 1)" ]; then
+            check="if (n != $2) { $check }"
+        fi
+        echo -n "$check "
+        k=$((k + 2))
+    done
+}
+div_prog="int zero; int imin; long lmin; long lmax;
+int id(int x) { return x + zero; }
+int div32(int n) { $(div_checks 1 imin) return 0; }
+int div64(long n) { $(div_checks 101 lmin) return 0; }
+int main() {
+  int i; int r; long m = 2147483647;
+  imin = (0 - 2147483647) - 1; lmin = 1; lmin = lmin << 63; lmax = lmin - 1;
+  for (i = 0; i < 300; i++) {
+    r = div32(i); if (r) return r; r = div32(0 - i); if (r) return r;
+    r = div32(imin + i); if (r) return r; r = div32(2147483647 - i); if (r) return r;
+    r = div64(i); if (r) return r; r = div64(0 - i); if (r) return r;
+    r = div64(m + i); if (r) return r; r = div64(0 - m - i); if (r) return r;
+    r = div64(lmin + i); if (r) return r; r = div64(lmax - i); if (r) return r;
+  }
+  return 0;
+}"
+test_ 0 "$div_prog"
+test_flags -fno-inline 0 "$div_prog"
 
 echo OK
@@ -13,6 +13,13 @@ static void test_vec() {
   vec_push(v, (void *)10);
   expect(1, v->len);
   expect(10, (int)vec_pop(v));
+
+  // Grow out of the inline storage.
+  for (int i = 0; i < VEC_INLINE_SIZE * 4; i++)
+    vec_push(v, (void *)(intptr_t)i);
+  expect(VEC_INLINE_SIZE * 4, v->len);
+  for (int i = 0; i < VEC_INLINE_SIZE * 4; i++)
+    expect(i, (int)(intptr_t)v->data[i]);
 }
 
 static void test_map() {
@@ -22,9 +29,71 @@ static void test_map() {
   expect((int)map_get(m, "b"), 2);
   map_set(m, "a", (void *)3);
   expect((int)map_get(m, "a"), 3);
+  expect(0, map_get(m, "c") != NULL);
+
+  // Rehash
+  for (int i = 0; i < 1000; i++)
+    map_set(m, format("k%d", i), (void *)(intptr_t)i);
+  for (int i = 0; i < 1000; i++)
+    expect(i, (int)(intptr_t)map_get(m, format("k%d", i)));
+  expect((int)(intptr_t)map_get(m, "a"), 3);
+
+  // Rehash in an arena
+  arena_begin();
+  m = new_map();
+  for (int i = 0; i < 1000; i++)
+    map_set(m, format("k%d", i), (void *)(intptr_t)i);
+  for (int i = 0; i < 1000; i++)
+    expect(i, (int)(intptr_t)map_get(m, format("k%d", i)));
+  arena_end();
+}
+
+static void expect_same_tokens(Vector *want, Vector *got) {
+  expect(want->len, got->len);
+  for (int i = 0; i < want->len; i++) {
+    Token *a = want->data[i];
+    Token *b = got->data[i];
+    expect(a->ty, b->ty);
+    expect(a->val, b->val);
+    expect(a->pos->line, b->pos->line);
+    expect(a->pos->offset, b->pos->offset);
+    if (a->name || b->name)
+      expect(0, strcmp(a->name, b->name));
+  }
+}
+
+static void test_tokenize_parallel() {
+  // Block comments and character literals cross the lines the parallel
+  // tokenizer splits at.
+  char *lines[] = {"int f(int a) { return a * 2 + 'x'; }\n", "/* a\n",
+                   "int g() { */ int a; // }\n", "char c = '\n';\n",
+                   "\n"};
+  int nlines = sizeof(lines) / sizeof(*lines);
+  int size = 1024 * 1024;
+  char *src = malloc(size + 256);
+  int len = 0;
+  while (len < size)
+    for (int i = 0; i < nlines; i++)
+      len += sprintf(src + len, "%s", lines[i]);
+
+  buf = src;
+  nthreads = 1;
+  Vector *want = tokenize();
+  for (nthreads = 2; nthreads <= 8; nthreads *= 2)
+    expect_same_tokens(want, tokenize());
+  nthreads = 1;
+}
+
+// The generated division itself is checked against idiv in test.sh.
+static void test_div_magic() {
+  DivMagic m = div_magic(7, 32);
+  expect(-1840700269, m.magic);
+  expect(2, m.shift);
 }
 
 void test() {
   test_vec();
   test_map();
+  test_tokenize_parallel();
+  test_div_magic();
 }
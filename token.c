@@ -1,17 +1,36 @@
 #include "mdcc.h"
+#include <pthread.h>
+
+// Inputs shorter than this per thread are not worth splitting.
+#define MIN_CHUNK_SIZE (64 * 1024)
+
+// Initial number of tokens a token stream holds at once.
+#define DEFAULT_STREAM_SIZE 256
 
 static Map *keywords;
 char *buf;
 
 typedef struct {
   char *src;  // source
+  int len;    // source length
   char ch;    // current character
   int offset; // character offset
   int line;   // line number
   int pos;    // reading position
+
+  // Set when the scanner lexes a chunk of a larger source. Errors are
+  // recorded instead of reported, and reaching the end of the chunk inside
+  // a block comment is not an error.
+  bool chunk;
+  bool in_comment;
+  bool failed;
 } Scanner;
 
 static void token_error(Scanner *s, char *msg) {
+  if (s->chunk) {
+    s->failed = true;
+    return;
+  }
   fprintf(stderr, "Error at line:%d, offset:%d, character:'%c'\n", s->line,
           s->offset, s->src[s->pos]);
   fprintf(stderr, "%s\n", msg);
@@ -26,16 +45,17 @@ static Position *new_position(Scanner *s) {
 }
 
 static Token *new_token(Scanner *s, int ty) {
-  Token *tok = malloc(sizeof(Token));
+  Token *tok = calloc(1, sizeof(Token));
   tok->ty = ty;
   tok->pos = new_position(s);
   return tok;
 }
 
-Scanner *new_scanner(char *src) {
-  Scanner *s = malloc(sizeof(Scanner));
-  s->src = strdup(src);
-  s->ch = s->src[0];
+static Scanner *new_scanner(char *src, int len) {
+  Scanner *s = calloc(1, sizeof(Scanner));
+  s->src = src;
+  s->len = len;
+  s->ch = len > 0 ? src[0] : -1;
   s->offset = 0;
   s->line = 1;
   s->pos = 0;
@@ -43,7 +63,7 @@ Scanner *new_scanner(char *src) {
 }
 
 static void next(Scanner *s) {
-  if (s->pos >= strlen(s->src) - 1) {
+  if (s->pos >= s->len - 1) {
     s->ch = -1;
   } else {
     if (s->ch == '\n') {
@@ -58,7 +78,7 @@ static void next(Scanner *s) {
 }
 
 static char peek_next(Scanner *s) {
-  if (s->pos >= strlen(s->src) - 1)
+  if (s->pos >= s->len - 1)
     return -1;
   return s->src[s->pos + 1];
 }
@@ -78,6 +98,10 @@ static void load_keywords() {
   map_set(keywords, "else", (void *)TK_ELSE);
   map_set(keywords, "for", (void *)TK_FOR);
   map_set(keywords, "while", (void *)TK_WHILE);
+  map_set(keywords, "switch", (void *)TK_SWITCH);
+  map_set(keywords, "case", (void *)TK_CASE);
+  map_set(keywords, "default", (void *)TK_DEFAULT);
+  map_set(keywords, "break", (void *)TK_BREAK);
 }
 
 static char *scan_ident(Scanner *s) {
@@ -107,11 +131,17 @@ static int scan_number(Scanner *s) {
 
 static void scan_block_comment(Scanner *s) {
   for (;;) {
-    if (s->ch == -1)
+    if (s->ch == -1) {
+      if (s->chunk) {
+        s->in_comment = true;
+        return;
+      }
       token_error(s, "unclosed comment");
+    }
     if (s->ch == '*' && peek_next(s) == '/') {
       next(s);
       next(s);
+      s->in_comment = false;
       return;
     }
     next(s);
@@ -167,72 +197,244 @@ static int switch4(Scanner *s, int tok0, int tok1, int tok2, int tok3) {
   return tok0;
 }
 
-Vector *tokenize() {
-  load_keywords();
+// Scans the next token. Returns NULL if only spaces or a comment were
+// skipped.
+static Token *lex_one(Scanner *s) {
+  char ch = s->ch;
+  Token *tok = NULL;
 
-  Vector *tokens = new_vec();
-  Scanner *s = new_scanner(buf);
-
-  while (1) {
-    char ch = s->ch;
-    Token *tok = NULL;
-
-    if (ch < 0) {
-      tok = new_token(s, TK_EOF);
-    } else if (isspace(ch)) {
-      skipSpaces(s);
-    } else if (isnondigit(ch)) {
-      char *name = scan_ident(s);
-      tok = new_token(s, (int)map_get_def(keywords, name, (void *)TK_IDENT));
-      tok->name = name;
-    } else if (isdigit(ch)) {
-      tok = new_token(s, TK_NUM);
-      tok->val = scan_number(s);
-    } else if (ch == '\'') {
+  if (ch < 0) {
+    tok = new_token(s, TK_EOF);
+  } else if (isspace(ch)) {
+    skipSpaces(s);
+  } else if (isnondigit(ch)) {
+    char *name = scan_ident(s);
+    tok = new_token(s, (int)map_get_def(keywords, name, (void *)TK_IDENT));
+    tok->name = name;
+  } else if (isdigit(ch)) {
+    tok = new_token(s, TK_NUM);
+    tok->val = scan_number(s);
+  } else if (ch == '\'') {
+    next(s);
+    tok = new_token(s, TK_NUM);
+    tok->val = scan_char(s);
+  } else if (ch == '+') {
+    tok = new_token(s, switch3(s, '+', TK_ADD_EQ, TK_INC));
+  } else if (ch == '-') {
+    tok = new_token(s, switch3(s, '-', TK_SUB_EQ, TK_DEC));
+  } else if (ch == '*') {
+    tok = new_token(s, switch2(s, '*', TK_MUL_EQ));
+  } else if (ch == '/') {
+    if (peek_next(s) == '*') {
       next(s);
-      tok = new_token(s, TK_NUM);
-      tok->val = scan_char(s);
-    } else if (ch == '+') {
-      tok = new_token(s, switch3(s, '+', TK_ADD_EQ, TK_INC));
-    } else if (ch == '-') {
-      tok = new_token(s, switch3(s, '-', TK_SUB_EQ, TK_DEC));
-    } else if (ch == '*') {
-      tok = new_token(s, switch2(s, '*', TK_MUL_EQ));
-    } else if (ch == '/') {
-      if (peek_next(s) == '*') {
-        next(s);
-        next(s);
-        scan_block_comment(s);
-      } else if (peek_next(s) == '/') {
-        next(s);
-        next(s);
-        scan_line_comment(s);
-      } else {
-        tok = new_token(s, switch2(s, '/', TK_DIV_EQ));
-      }
-    } else if (ch == '!') {
-      tok = new_token(s, switch2(s, '!', TK_NEQ));
-    } else if (ch == '=') {
-      tok = new_token(s, switch2(s, '=', TK_EQ));
-    } else if (ch == '^') {
-      tok = new_token(s, switch2(s, '^', TK_XOR_EQ));
-    } else if (ch == '&') {
-      tok = new_token(s, switch3(s, '&', TK_BAND_EQ, TK_AND));
-    } else if (ch == '|') {
-      tok = new_token(s, switch3(s, '|', TK_BOR_EQ, TK_OR));
-    } else if (ch == '<') {
-      tok = new_token(s, switch4(s, '<', TK_LEQ, TK_SHL, TK_SHL_EQ));
-    } else if (ch == '>') {
-      tok = new_token(s, switch4(s, '>', TK_GEQ, TK_SHR, TK_SHR_EQ));
-    } else {
-      tok = new_token(s, ch);
       next(s);
+      scan_block_comment(s);
+    } else if (peek_next(s) == '/') {
+      next(s);
+      next(s);
+      scan_line_comment(s);
+    } else {
+      tok = new_token(s, switch2(s, '/', TK_DIV_EQ));
     }
+  } else if (ch == '!') {
+    tok = new_token(s, switch2(s, '!', TK_NEQ));
+  } else if (ch == '=') {
+    tok = new_token(s, switch2(s, '=', TK_EQ));
+  } else if (ch == '^') {
+    tok = new_token(s, switch2(s, '^', TK_XOR_EQ));
+  } else if (ch == '&') {
+    tok = new_token(s, switch3(s, '&', TK_BAND_EQ, TK_AND));
+  } else if (ch == '|') {
+    tok = new_token(s, switch3(s, '|', TK_BOR_EQ, TK_OR));
+  } else if (ch == '<') {
+    tok = new_token(s, switch4(s, '<', TK_LEQ, TK_SHL, TK_SHL_EQ));
+  } else if (ch == '>') {
+    tok = new_token(s, switch4(s, '>', TK_GEQ, TK_SHR, TK_SHR_EQ));
+  } else {
+    tok = new_token(s, ch);
+    next(s);
+  }
+  return tok;
+}
+
+static void lex(Scanner *s, Vector *tokens) {
+  if (s->in_comment)
+    scan_block_comment(s);
+
+  while (!s->failed) {
+    Token *tok = lex_one(s);
     if (tok != NULL) {
       vec_push(tokens, tok);
       if (tok->ty == TK_EOF)
         break;
     }
   }
+}
+
+typedef struct {
+  Scanner *s;
+  Vector *tokens;
+} Lexed;
+
+// A chunk starts right after a newline. Since no token spans a newline
+// except block comments, the lexer state at the start of a chunk is either
+// "in code" or "in a block comment". Chunks are speculatively lexed as if
+// they start in code, which is almost always right; the few chunks whose
+// previous chunk turns out to end inside a comment are lexed again.
+typedef struct {
+  char *src;
+  int len;
+  int nlines; // number of newlines in the chunk
+  Lexed lexed;
+} Chunk;
+
+static Lexed lex_chunk(char *src, int len, bool in_comment) {
+  Lexed l;
+  l.s = new_scanner(src, len);
+  l.s->chunk = true;
+  l.s->in_comment = in_comment;
+  l.tokens = new_vec();
+  lex(l.s, l.tokens);
+  return l;
+}
+
+static void *lex_worker(void *arg) {
+  Chunk *c = arg;
+  for (int i = 0; i < c->len; i++)
+    if (c->src[i] == '\n')
+      c->nlines++;
+  c->lexed = lex_chunk(c->src, c->len, false);
+  return NULL;
+}
+
+// Returns the end of a chunk starting at p, or len if there is no newline
+// to split at. Newlines right after a quote may be a character literal.
+static int chunk_end(int p, int len) {
+  int i = p + len / nthreads;
+  while (i < len && (buf[i] != '\n' || buf[i - 1] == '\''))
+    i++;
+  return i < len ? i + 1 : len;
+}
+
+// Concatenates the lexed chunks. Returns NULL if a chunk could not be lexed
+// the way the serial tokenizer would, in which case the caller falls back
+// to it (and to its error reporting).
+static Vector *stitch(Chunk *chunks, int nchunks) {
+  Vector *tokens = new_vec();
+  bool in_comment = false;
+  int line = 0;
+  for (int i = 0; i < nchunks; i++) {
+    Lexed *l = &chunks[i].lexed;
+    if (in_comment)
+      *l = lex_chunk(chunks[i].src, chunks[i].len, true);
+    // A negative character stops the serial tokenizer in the middle.
+    if (l->s->failed || l->s->pos < l->s->len - 1)
+      return NULL;
+    bool last = i == nchunks - 1;
+    for (int j = 0; j < l->tokens->len; j++) {
+      Token *tok = l->tokens->data[j];
+      if (tok->ty == TK_EOF && !last)
+        continue;
+      tok->pos->line += line;
+      vec_push(tokens, tok);
+    }
+    in_comment = l->s->in_comment;
+    line += chunks[i].nlines;
+  }
+  if (in_comment)
+    return NULL;
+  return tokens;
+}
+
+static Vector *tokenize_parallel(int len) {
+  Chunk *chunks = calloc(nthreads, sizeof(Chunk));
+  pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+  int nchunks = 0;
+  for (int p = 0; p < len; nchunks++) {
+    int end = nchunks == nthreads - 1 ? len : chunk_end(p, len);
+    chunks[nchunks].src = buf + p;
+    chunks[nchunks].len = end - p;
+    p = end;
+  }
+  for (int i = 0; i < nchunks; i++)
+    if (pthread_create(&threads[i], NULL, lex_worker, &chunks[i]))
+      error("Failed to create a lexer thread");
+  for (int i = 0; i < nchunks; i++)
+    pthread_join(threads[i], NULL);
+  return stitch(chunks, nchunks);
+}
+
+Vector *tokenize() {
+  load_keywords();
+
+  int len = strlen(buf);
+  if (nthreads > 1 && len >= nthreads * MIN_CHUNK_SIZE) {
+    Vector *tokens = tokenize_parallel(len);
+    if (tokens)
+      return tokens;
+  }
+
+  Vector *tokens = new_vec();
+  lex(new_scanner(buf, len), tokens);
   return tokens;
 }
+
+struct TokenStream {
+  Scanner *s;
+  Token **ring;
+  int cap;
+  int start; // index of the oldest token in the ring
+  int end;   // index past the newest token
+};
+
+TokenStream *new_token_stream() {
+  load_keywords();
+
+  TokenStream *ts = malloc(sizeof(TokenStream));
+  ts->s = new_scanner(buf, strlen(buf));
+  ts->cap = DEFAULT_STREAM_SIZE;
+  ts->ring = malloc(sizeof(Token *) * ts->cap);
+  ts->start = 0;
+  ts->end = 0;
+  return ts;
+}
+
+static void release_token(Token *tok) {
+  free(tok->name);
+  free(tok->pos);
+  free(tok);
+}
+
+static void grow_stream(TokenStream *ts) {
+  int cap = ts->cap * 2;
+  Token **ring = malloc(sizeof(Token *) * cap);
+  for (int i = ts->start; i < ts->end; i++)
+    ring[i % cap] = ts->ring[i % ts->cap];
+  free(ts->ring);
+  ts->ring = ring;
+  ts->cap = cap;
+}
+
+Token *stream_peek(TokenStream *ts, int p, int keep) {
+  if (p < ts->start)
+    error("Token %d is already released", p);
+
+  while (p >= ts->end) {
+    // Keep returning EOF once the source is consumed.
+    if (ts->end > 0 && ts->ring[(ts->end - 1) % ts->cap]->ty == TK_EOF)
+      return ts->ring[(ts->end - 1) % ts->cap];
+
+    if (ts->end - ts->start == ts->cap) {
+      while (ts->start < keep && ts->start < ts->end)
+        release_token(ts->ring[ts->start++ % ts->cap]);
+      if (ts->end - ts->start == ts->cap)
+        grow_stream(ts);
+    }
+
+    Token *tok;
+    while ((tok = lex_one(ts->s)) == NULL)
+      ;
+    ts->ring[ts->end++ % ts->cap] = tok;
+  }
+  return ts->ring[p % ts->cap];
+}
@@ -1,6 +1,15 @@
 #include "mdcc.h"
 
-#define DEFAULT_VEC_SIZE 16
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  char *top; // next free byte
+  char *end;
+} ArenaChunk;
+
+// Chunks of the active arena, newest first. NULL if no arena is active.
+static ArenaChunk *arena;
 
 __attribute__((noreturn)) void error(char *fmt, ...) {
   va_list ap;
@@ -10,18 +19,79 @@ __attribute__((noreturn)) void error(char *fmt, ...) {
   exit(1);
 }
 
+static ArenaChunk *new_arena_chunk(size_t size) {
+  if (size < ARENA_CHUNK_SIZE)
+    size = ARENA_CHUNK_SIZE;
+  ArenaChunk *c = malloc(sizeof(ArenaChunk) + size);
+  c->next = NULL;
+  c->top = (char *)(c + 1);
+  c->end = c->top + size;
+  return c;
+}
+
+/**
+ * Start allocating from an arena. Everything alloc() returns from now on is
+ * released at once by arena_end().
+ */
+void arena_begin() {
+  assert(arena == NULL);
+  arena = new_arena_chunk(0);
+}
+
+void arena_end() {
+  while (arena) {
+    ArenaChunk *next = arena->next;
+    free(arena);
+    arena = next;
+  }
+}
+
+/**
+ * Allocate zero-initialized memory, from the arena if one is active.
+ */
+void *alloc(size_t size) {
+  if (arena == NULL)
+    return calloc(1, size);
+
+  size = roundup(size, 16);
+  if (arena->end - arena->top < size) {
+    ArenaChunk *c = new_arena_chunk(size);
+    c->next = arena;
+    arena = c;
+  }
+  void *p = arena->top;
+  arena->top += size;
+  memset(p, 0, size);
+  return p;
+}
+
+char *alloc_str(char *s) {
+  int len = strlen(s);
+  char *p = alloc(len + 1);
+  memcpy(p, s, len);
+  return p;
+}
+
 Vector *new_vec() {
-  Vector *v = malloc(sizeof(Vector));
-  v->data = malloc(sizeof(void *) * DEFAULT_VEC_SIZE);
+  Vector *v = alloc(sizeof(Vector));
+  v->data = v->inline_data;
   v->len = 0;
-  v->capacity = DEFAULT_VEC_SIZE;
+  v->capacity = VEC_INLINE_SIZE;
+  v->in_arena = arena != NULL;
   return v;
 }
 
 void vec_push(Vector *v, void *elm) {
   if (v->len == v->capacity) {
     v->capacity *= 2;
-    v->data = realloc(v->data, sizeof(void *) * v->capacity);
+    if (v->in_arena || v->data == v->inline_data) {
+      void **data = v->in_arena ? alloc(sizeof(void *) * v->capacity)
+                                : malloc(sizeof(void *) * v->capacity);
+      memcpy(data, v->data, sizeof(void *) * v->len);
+      v->data = data;
+    } else {
+      v->data = realloc(v->data, sizeof(void *) * v->capacity);
+    }
   }
   v->data[v->len++] = elm;
 }
@@ -29,19 +99,54 @@ void vec_push(Vector *v, void *elm) {
 void *vec_pop(Vector *v) { return v->data[--v->len]; }
 
 Map *new_map(void) {
-  Map *map = malloc(sizeof(Map));
+  Map *map = alloc(sizeof(Map));
   map->keys = new_vec();
   map->vals = new_vec();
+  map->chain = new_vec();
+  map->in_arena = arena != NULL;
   return map;
 }
 
+unsigned hash_str(char *s) {
+  unsigned h = 2166136261;
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619;
+  return h;
+}
+
+static void map_index(Map *map, int i) {
+  int h = hash_str(map->keys->data[i]) & (map->nbuckets - 1);
+  map->chain->data[i] = (void *)(intptr_t)map->buckets[h];
+  map->buckets[h] = i;
+}
+
+static void map_rehash(Map *map) {
+  if (!map->in_arena)
+    free(map->buckets);
+  map->nbuckets = map->nbuckets ? map->nbuckets * 2 : 16;
+  map->buckets = map->in_arena ? alloc(sizeof(int) * map->nbuckets)
+                               : malloc(sizeof(int) * map->nbuckets);
+  for (int i = 0; i < map->nbuckets; i++)
+    map->buckets[i] = -1;
+  for (int i = 0; i < map->keys->len; i++)
+    map_index(map, i);
+}
+
 void map_set(Map *map, char *key, void *val) {
   vec_push(map->keys, key);
   vec_push(map->vals, val);
+  vec_push(map->chain, NULL);
+  if (map->keys->len > map->nbuckets)
+    map_rehash(map);
+  else
+    map_index(map, map->keys->len - 1);
 }
 
 void *map_get(Map *map, char *key) {
-  for (int i = map->keys->len - 1; i >= 0; i--)
+  if (map->nbuckets == 0)
+    return NULL;
+  int h = hash_str(key) & (map->nbuckets - 1);
+  for (int i = map->buckets[h]; i >= 0; i = (intptr_t)map->chain->data[i])
     if (!strcmp(map->keys->data[i], key))
       return map->vals->data[i];
   return NULL;
@@ -60,7 +165,7 @@ char *format(char *fmt, ...) {
   va_start(ap, fmt);
   vsnprintf(buf, sizeof(buf), fmt, ap);
   va_end(ap);
-  return strdup(buf);
+  return alloc_str(buf);
 }
 
 /**
@@ -74,8 +179,56 @@ char *format(char *fmt, ...) {
  */
 inline int roundup(int x, int align) { return (x + align - 1) & ~(align - 1); }
 
+/**
+ * Computes the magic number dividing a signed integer of the given bits (32
+ * or 64) by d, where |d| >= 2 is not a power of two (Hacker's Delight,
+ * 10-1). Let h be the high half of the product n * magic, plus n if d > 0
+ * and magic < 0, or minus n if d < 0 and magic > 0. Then n / d is h
+ * arithmetically shifted right by shift, plus 1 if that is negative.
+ *
+ * Example:
+ *   div_magic(7, 32) // => {-1840700269, 2}
+ *
+ */
+DivMagic div_magic(long d, int bits) {
+  // The computation is done modulo 2^bits like the reference.
+  unsigned long mask = bits == 64 ? ~0UL : (1UL << bits) - 1;
+  unsigned long two = 1UL << (bits - 1);
+  unsigned long ad = (d < 0 ? -(unsigned long)d : (unsigned long)d) & mask;
+  unsigned long t = two + (d < 0);
+  unsigned long anc = t - 1 - t % ad; // |nc|
+  unsigned long q1 = two / anc, r1 = two - q1 * anc;
+  unsigned long q2 = two / ad, r2 = two - q2 * ad;
+  unsigned long delta;
+  int p = bits - 1;
+  do {
+    p++;
+    q1 = (q1 * 2) & mask;
+    r1 = (r1 * 2) & mask;
+    if (r1 >= anc) {
+      q1 = (q1 + 1) & mask;
+      r1 = (r1 - anc) & mask;
+    }
+    q2 = (q2 * 2) & mask;
+    r2 = (r2 * 2) & mask;
+    if (r2 >= ad) {
+      q2 = (q2 + 1) & mask;
+      r2 = (r2 - ad) & mask;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  unsigned long magic = q2 + 1;
+  if (d < 0)
+    magic = -magic;
+  DivMagic m;
+  m.magic = bits == 32 ? (int)magic : (long)magic;
+  m.shift = p - bits;
+  return m;
+}
+
 Type *new_type(int ty, int size) {
-  Type *t = malloc(sizeof(Type));
+  Type *t = alloc(sizeof(Type));
   t->ty = ty;
   t->size = size;
   t->align = size;
@@ -88,17 +241,66 @@ Type *ptr(Type *ty) {
   return t;
 }
 
-Node *new_node(int ty, Node *lhs, Node *rhs) {
-  Node *node = malloc(sizeof(Node));
+#define FIELD_END(field) (offsetof(Node, field) + sizeof(((Node *)0)->field))
+
+// Returns the number of bytes a node of the given type needs.
+size_t node_size(int ty) {
+  switch (ty) {
+  case ND_NULL:
+  case ND_BREAK:
+    return offsetof(Node, val);
+  case ND_NUM:
+    return FIELD_END(val);
+  case ND_IDENT:
+    return FIELD_END(var);
+  case ND_INITS:
+    return FIELD_END(inits);
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_INC:
+  case ND_DEC:
+    return FIELD_END(expr);
+  case ND_COMP_STMT:
+    return FIELD_END(stmts);
+  case ND_ROOT:
+    return FIELD_END(globals);
+  case ND_CALL:
+    return FIELD_END(args);
+  case ND_FUNC:
+    return FIELD_END(body);
+  case ND_WHILE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_INLINE: // cond is read as NULL by the passes sharing ND_WHILE cases
+    return FIELD_END(cond);
+  case ND_IF:
+    return FIELD_END(els);
+  case ND_FOR:
+  case ND_VECTOR:
+    return FIELD_END(after);
+  case ND_OPASSIGN:
+    return FIELD_END(op);
+  default:
+    return FIELD_END(rhs);
+  }
+}
+
+Node *alloc_node(int ty) {
+  Node *node = alloc(node_size(ty));
   node->ty = ty;
+  return node;
+}
+
+Node *new_node(int ty, Node *lhs, Node *rhs) {
+  Node *node = alloc_node(ty);
   node->lhs = lhs;
   node->rhs = rhs;
   return node;
 }
 
 Node *new_node_one(int ty, Node *expr) {
-  Node *node = malloc(sizeof(Node));
-  node->ty = ty;
+  Node *node = alloc_node(ty);
   node->expr = expr;
   return node;
 }
@@ -110,9 +312,285 @@ Type *new_int_ty() { return new_type(TY_INT, 4); }
 Type *new_char_ty() { return new_type(TY_CHAR, 1); }
 
 Node *new_node_num(int val) {
-  Node *node = malloc(sizeof(Node));
-  node->ty = ND_NUM;
+  Node *node = alloc_node(ND_NUM);
   node->val = val;
   node->cty = new_int_ty();
   return node;
 }
+
+// Adds a temporary variable of the type to the function.
+Var *new_temp(Node *func, Type *ty) {
+  Var *var = alloc(sizeof(Var));
+  var->ty = ty;
+  var->name = "";
+  vec_push(func->func_vars, var);
+  return var;
+}
+
+Node *new_ident(Var *var) {
+  Node *node = alloc_node(ND_IDENT);
+  node->var = var;
+  node->cty = var->ty;
+  return node;
+}
+
+Node *new_assign(Var *var, Node *rhs) {
+  Node *node = new_node('=', new_ident(var), rhs);
+  node->cty = var->ty;
+  return node;
+}
+
+/**
+ * Returns true if the value of the variable is only changed by assigning
+ * the variable itself, so that passes can follow it. Its address is never
+ * taken, and it is not an array.
+ */
+bool is_tracked(Var *var) {
+  return !var->escaped && !var->has_address && var->ty->ty != TY_ARR;
+}
+
+// Appends the ND_CALL nodes in the tree to calls.
+void collect_calls(Node *node, Vector *calls) {
+  if (node == NULL)
+    return;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return;
+  case ND_CALL:
+    vec_push(calls, node);
+    for (int i = 0; i < node->args->len; i++)
+      collect_calls(node->args->data[i], calls);
+    return;
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      collect_calls(node->stmts->data[i], calls);
+    return;
+  case ND_ROOT:
+    for (int i = 0; i < node->funcs->len; i++)
+      collect_calls(node->funcs->data[i], calls);
+    return;
+  case ND_INITS:
+    for (int i = 0; i < node->inits->len; i++)
+      collect_calls(node->inits->data[i], calls);
+    return;
+  case ND_FUNC:
+    collect_calls(node->body, calls);
+    return;
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_INC:
+  case ND_DEC:
+    collect_calls(node->expr, calls);
+    return;
+  case ND_IF:
+    collect_calls(node->cond, calls);
+    collect_calls(node->then, calls);
+    collect_calls(node->els, calls);
+    return;
+  case ND_FOR:
+  case ND_VECTOR:
+    collect_calls(node->init, calls);
+    collect_calls(node->cond, calls);
+    collect_calls(node->after, calls);
+    collect_calls(node->body, calls);
+    return;
+  case ND_WHILE:
+  case ND_SWITCH:
+    collect_calls(node->cond, calls);
+    collect_calls(node->body, calls);
+    return;
+  case ND_INLINE:
+    collect_calls(node->body, calls);
+    return;
+  default:
+    collect_calls(node->lhs, calls);
+    collect_calls(node->rhs, calls);
+  }
+}
+
+// Sets the escaped flag of the variables whose address is taken in node.
+void mark_escaped(Node *node) {
+  if (node == NULL)
+    return;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return;
+  case ND_CALL:
+    for (int i = 0; i < node->args->len; i++)
+      mark_escaped(node->args->data[i]);
+    return;
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      mark_escaped(node->stmts->data[i]);
+    return;
+  case ND_INITS:
+    for (int i = 0; i < node->inits->len; i++)
+      mark_escaped(node->inits->data[i]);
+    return;
+  case ND_ADDR:
+    // The address of an array is its value.
+    if (node->expr->ty == ND_IDENT && node->expr->cty->ty != TY_ARR)
+      node->expr->var->escaped = true;
+    // fallthrough
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_INC:
+  case ND_DEC:
+    mark_escaped(node->expr);
+    return;
+  case ND_IF:
+    mark_escaped(node->cond);
+    mark_escaped(node->then);
+    mark_escaped(node->els);
+    return;
+  case ND_FOR:
+  case ND_VECTOR:
+    mark_escaped(node->init);
+    mark_escaped(node->cond);
+    mark_escaped(node->after);
+    mark_escaped(node->body);
+    return;
+  case ND_WHILE:
+  case ND_SWITCH:
+  case ND_INLINE:
+    mark_escaped(node->cond);
+    mark_escaped(node->body);
+    return;
+  default:
+    mark_escaped(node->lhs);
+    mark_escaped(node->rhs);
+  }
+}
+
+int count_nodes(Node *node) {
+  if (node == NULL)
+    return 0;
+  int n = 1;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return n;
+  case ND_CALL:
+    for (int i = 0; i < node->args->len; i++)
+      n += count_nodes(node->args->data[i]);
+    return n;
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      n += count_nodes(node->stmts->data[i]);
+    return n;
+  case ND_INITS:
+    for (int i = 0; i < node->inits->len; i++)
+      n += count_nodes(node->inits->data[i]);
+    return n;
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_INC:
+  case ND_DEC:
+    return n + count_nodes(node->expr);
+  case ND_IF:
+    return n + count_nodes(node->cond) + count_nodes(node->then) +
+           count_nodes(node->els);
+  case ND_FOR:
+  case ND_VECTOR:
+    return n + count_nodes(node->init) + count_nodes(node->cond) +
+           count_nodes(node->after) + count_nodes(node->body);
+  case ND_WHILE:
+  case ND_SWITCH:
+  case ND_INLINE:
+    return n + count_nodes(node->cond) + count_nodes(node->body);
+  default:
+    return n + count_nodes(node->lhs) + count_nodes(node->rhs);
+  }
+}
+
+static Var *remap(Var *var, Vector *from_vars, Vector *to_vars) {
+  if (from_vars == NULL || var->label)
+    return var;
+  for (int i = 0; i < from_vars->len; i++)
+    if (from_vars->data[i] == var)
+      return to_vars->data[i];
+  error("Unknown variable %s", var->name);
+}
+
+static Vector *copy_nodes(Vector *v, Vector *from_vars, Vector *to_vars) {
+  Vector *v2 = new_vec();
+  for (int i = 0; i < v->len; i++)
+    vec_push(v2, copy_node(v->data[i], from_vars, to_vars));
+  return v2;
+}
+
+/**
+ * Deep copies a node. Variables in from_vars are replaced with the ones at
+ * the same index in to_vars. If from_vars is NULL, the copy refers to the
+ * same variables.
+ */
+Node *copy_node(Node *node, Vector *from_vars, Vector *to_vars) {
+  if (node == NULL)
+    return NULL;
+  Node *node2 = alloc_node(node->ty);
+  memcpy(node2, node, node_size(node->ty));
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_NULL:
+  case ND_CASE: // the value is shared
+  case ND_BREAK:
+    return node2;
+  case ND_IDENT:
+    node2->var = remap(node->var, from_vars, to_vars);
+    return node2;
+  case ND_INITS:
+    node2->var = remap(node->var, from_vars, to_vars);
+    node2->inits = copy_nodes(node->inits, from_vars, to_vars);
+    return node2;
+  case ND_CALL:
+    node2->args = copy_nodes(node->args, from_vars, to_vars);
+    return node2;
+  case ND_COMP_STMT:
+    node2->stmts = copy_nodes(node->stmts, from_vars, to_vars);
+    return node2;
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_INC:
+  case ND_DEC:
+    node2->expr = copy_node(node->expr, from_vars, to_vars);
+    return node2;
+  case ND_IF:
+    node2->cond = copy_node(node->cond, from_vars, to_vars);
+    node2->then = copy_node(node->then, from_vars, to_vars);
+    node2->els = copy_node(node->els, from_vars, to_vars);
+    return node2;
+  case ND_FOR:
+  case ND_VECTOR:
+    node2->init = copy_node(node->init, from_vars, to_vars);
+    node2->cond = copy_node(node->cond, from_vars, to_vars);
+    node2->after = copy_node(node->after, from_vars, to_vars);
+    node2->body = copy_node(node->body, from_vars, to_vars);
+    return node2;
+  case ND_WHILE:
+  case ND_SWITCH:
+    node2->cond = copy_node(node->cond, from_vars, to_vars);
+    node2->body = copy_node(node->body, from_vars, to_vars);
+    return node2;
+  case ND_INLINE:
+    node2->body = copy_node(node->body, from_vars, to_vars);
+    return node2;
+  default:
+    node2->lhs = copy_node(node->lhs, from_vars, to_vars);
+    node2->rhs = copy_node(node->rhs, from_vars, to_vars);
+    return node2;
+  }
+}
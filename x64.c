@@ -1,7 +1,34 @@
 #include "mdcc.h"
 
+// Section for functions only called from error paths (-fcold-section).
+#ifdef __APPLE__
+#define COLD_SECTION "section __TEXT,__text_cold,regular,pure_instructions"
+#define RODATA_SECTION "section __TEXT,__const"
+#else
+#define COLD_SECTION "section .text.unlikely,\"ax\",@progbits"
+#define RODATA_SECTION "section .rodata"
+#endif
+
+// Switches with at most this many cases compare the value with each case in
+// turn, and so do the leaves of the binary search over larger ones.
+#define SWITCH_LINEAR_CASES 4
+// A switch jumps through a table if at least 1 in this many of its entries
+// are cases.
+#define JUMP_TABLE_DENSITY 4
+// Array initializers and zero fills of at least this many bytes are done by
+// rep movsb and rep stosb instead of a store per element.
+#define BULK_INIT_SIZE 128
+
 static int nlabel = 1;
 
+// Label at the end of the inlined call being generated, if any, and the
+// number of values pushed when the call started.
+static char *inline_end;
+static int inline_depth;
+
+// Label at the end of the switch being generated, where break jumps to.
+static char *break_label;
+
 enum {
   RAX = 0,
   RDI,
@@ -54,31 +81,92 @@ static char *bb_label() { return format("MDCC_BB_%d", nlabel++); }
 
 static void emit_directive(char *s) { printf(".%s\n", s); }
 
+// Values narrower than 32 bits are kept sign-extended to 32 bits in
+// registers, so that no partial register is ever written and read back.
+static int full_size(int size) { return size < 4 ? 4 : size; }
+
 static void emit_conv_to_full(int r, int size) {
-  if (size != 8 && size != 4)
-    emit("movzx %s, %s", reg(r, 8), reg(r, size));
+  if (size == 1)
+    emit("movsx %s, %s", reg(r, 4), reg(r, 1));
+}
+
+// Loads a value of the size from memory into the full register.
+static void emit_load(int r, char *mem, int size) {
+  if (size == 1)
+    emit("movsx %s, byte ptr %s", reg(r, 4), mem);
+  else
+    emit("mov %s, %s", reg(r, size), mem);
+}
+
+// Sign-extends a value of the size in a register to the size of the
+// operation using it. An int only sets the low half of a register, which
+// is zero-extended, and a char is already extended to 32 bits.
+static void emit_widen(int r, int size, int to) {
+  if (to == 8 && size < 8)
+    emit("movsxd %s, %s", reg(r, 8), reg(r, 4));
+}
+
+// Copies a value of the size from a register into a register variable.
+static void emit_to_var(Var *var, int r, int size) {
+  if (size == 1)
+    emit("movsx %s, %s", reg(var->reg, 4), reg(r, 1));
+  else
+    emit("mov %s, %s", reg(var->reg, size), reg(r, size));
+}
+
+// Number of 8-byte values pushed since the prologue, which leaves rsp
+// aligned to 16 bytes.
+static int depth;
+
+static void push(char *s) {
+  emit("push %s", s);
+  depth++;
+}
+
+static void pop(char *s) {
+  emit("pop %s", s);
+  depth--;
+}
+
+// A leaf function does not set up rbp (-fomit-frame-pointer). Its frame of
+// frame_size bytes is addressed off rsp, past the values pushed since.
+static bool frameless;
+static int frame_size;
+
+// Returns the register addressing the frame, and adds the offset of rbp
+// from it to *disp. The rbp of a frameless function is the rsp on entry.
+static char *frame_base(int *disp) {
+  if (!frameless)
+    return "rbp";
+  *disp += frame_size + depth * 8;
+  return "rsp";
+}
+
+// Returns the operand of the frame at rbp + disp.
+static char *frame_addr(int disp) {
+  char *base = frame_base(&disp);
+  if (disp == 0)
+    return format("[%s]", base);
+  if (disp < 0)
+    return format("[%s - %d]", base, -disp);
+  return format("[%s + %d]", base, disp);
 }
 
 static void emit_push(int r, int size) {
   emit_conv_to_full(r, size);
-  emit("push %s", reg(r, 8));
+  push(reg(r, 8));
 }
 
 static void gen(Node *node);
+static void gen_stmt(Node *node);
 
-static void gen_binary(Node *node) {
-  gen(node->lhs);
-  gen(node->rhs);
-
-  int sz = node->cty->size;
+// Applies the binary operator to rax and r11, leaving the result in rax.
+static void emit_op(int op, int sz) {
   char *r11 = reg(R11, sz);
   char *rax = reg(RAX, sz);
   char *rdx = reg(RDX, sz);
 
-  emit("pop r11");
-  emit("pop rax");
-
-  switch (node->ty) {
+  switch (op) {
   case '+':
     emit("add %s, %s", rax, r11);
     break;
@@ -89,20 +177,118 @@ static void gen_binary(Node *node) {
     emit("imul %s, %s", rax, r11);
     break;
   case '/':
-    emit("mov %s, 0", rdx);
-    emit("div %s", r11);
+    emit(sz == 8 ? "cqo" : "cdq");
+    emit("idiv %s", r11);
     break;
   case '%':
-    emit("mov %s, 0", rdx);
-    emit("div %s", r11);
+    emit(sz == 8 ? "cqo" : "cdq");
+    emit("idiv %s", r11);
     emit("mov %s, %s", rax, rdx);
     break;
+  case '&':
+    emit("and %s, %s", rax, r11);
+    break;
+  case '|':
+    emit("or %s, %s", rax, r11);
+    break;
+  case '^':
+    emit("xor %s, %s", rax, r11);
+    break;
   case ND_SHL:
-    emit("shl %s, %s", rax, r11);
+    emit("mov rcx, r11");
+    emit("shl %s, cl", rax);
+    break;
+  case ND_SHR:
+    emit("mov rcx, r11");
+    emit("shr %s, cl", rax);
     break;
   default:
-    error("Unknown binary operator %d", node->ty);
+    error("Unknown binary operator %d", op);
+  }
+}
+
+static bool is_div_const(int op, Node *rhs) {
+  return (op == '/' || op == '%') && rhs->ty == ND_NUM && rhs->val != 0;
+}
+
+/**
+ * Divides rax by the constant d without idiv, rounding toward zero. A
+ * power of two is a shift of the dividend biased by |d| - 1 if it is
+ * negative. Other divisors multiply by a magic number (see div_magic()).
+ * The remainder is n - n / d * d.
+ */
+static void emit_div_const(int op, long d, int sz) {
+  int bits = sz * 8;
+  char *rax = reg(RAX, sz);
+  char *rcx = reg(RCX, sz);
+  char *rdx = reg(RDX, sz);
+  unsigned long ad = d < 0 ? -(unsigned long)d : d;
+
+  if (ad == 1) {
+    if (op == '%')
+      emit("xor eax, eax");
+    else if (d < 0)
+      emit("neg %s", rax);
+    return;
+  }
+
+  emit("mov %s, %s", rcx, rax);
+  if ((ad & (ad - 1)) == 0) {
+    int k = 0;
+    while ((1UL << k) != ad)
+      k++;
+    emit("mov %s, %s", rdx, rax);
+    emit("sar %s, %d", rdx, bits - 1);
+    emit("shr %s, %d", rdx, bits - k);
+    emit("add %s, %s", rax, rdx);
+    if (op == '/') {
+      emit("sar %s, %d", rax, k);
+      if (d < 0)
+        emit("neg %s", rax);
+      return;
+    }
+    emit("and %s, %ld", rax, -(long)ad);
+    emit("sub %s, %s", rcx, rax);
+    emit("mov %s, %s", rax, rcx);
+    return;
+  }
+
+  DivMagic m = div_magic(d, bits);
+  emit("mov %s, %ld", reg(R11, sz), m.magic);
+  emit("imul %s", reg(R11, sz));
+  if (d > 0 && m.magic < 0)
+    emit("add %s, %s", rdx, rcx);
+  if (d < 0 && m.magic > 0)
+    emit("sub %s, %s", rdx, rcx);
+  if (m.shift)
+    emit("sar %s, %d", rdx, m.shift);
+  emit("mov %s, %s", rax, rdx);
+  emit("shr %s, %d", rdx, bits - 1);
+  emit("add %s, %s", rax, rdx);
+  if (op == '%') {
+    emit("imul %s, %s, %ld", rax, rax, d);
+    emit("sub %s, %s", rcx, rax);
+    emit("mov %s, %s", rax, rcx);
+  }
+}
+
+static void gen_binary(Node *node) {
+  int sz = node->cty->size;
+  if (is_div_const(node->ty, node->rhs)) {
+    gen(node->lhs);
+    pop("rax");
+    emit_widen(RAX, node->lhs->cty->size, sz);
+    emit_div_const(node->ty, node->rhs->val, sz);
+    emit_push(RAX, sz);
+    return;
   }
+  gen(node->lhs);
+  gen(node->rhs);
+  pop("r11");
+  pop("rax");
+  emit_widen(RAX, node->lhs->cty->size, sz);
+  emit_widen(R11, node->rhs->cty->size, sz);
+  emit_op(node->ty, sz);
   emit_push(RAX, sz);
 }
 
@@ -111,9 +297,11 @@ static void gen_cmp(Node *node) {
   char *last_label = bb_label();
   gen(node->lhs);
   gen(node->rhs);
-  emit("pop r11");
-  emit("pop rax");
+  pop("r11");
+  pop("rax");
   int sz = node->cty->size;
+  emit_widen(RAX, node->lhs->cty->size, sz);
+  emit_widen(R11, node->rhs->cty->size, sz);
   emit("cmp %s, %s", reg(RAX, sz), reg(R11, sz));
   switch (node->ty) {
   case ND_EQ:
@@ -131,13 +319,54 @@ static void gen_cmp(Node *node) {
   default:
     error("Unknown comparator %d", node->ty);
   }
+  // Only one of the results is pushed.
   emit("push 0");
   emit("jmp %s", last_label);
   emit_label(true_label);
-  emit("push 1");
+  push("1");
   emit_label(last_label);
 }
 
+static char *jcc(int ty, bool if_true) {
+  switch (ty) {
+  case ND_EQ:
+    return if_true ? "je" : "jne";
+  case ND_NEQ:
+    return if_true ? "jne" : "je";
+  case '<':
+    return if_true ? "jl" : "jge";
+  case '>':
+    return if_true ? "jg" : "jle";
+  }
+  error("Unknown comparator %d", ty);
+}
+
+// Jumps to the label if cond is if_true. A comparison jumps on its flags
+// instead of pushing its result.
+static void gen_branch(Node *cond, char *label, bool if_true) {
+  switch (cond->ty) {
+  case ND_EQ:
+  case ND_NEQ:
+  case '<':
+  case '>': {
+    gen(cond->lhs);
+    gen(cond->rhs);
+    pop("r11");
+    pop("rax");
+    int sz = cond->cty->size;
+    emit_widen(RAX, cond->lhs->cty->size, sz);
+    emit_widen(R11, cond->rhs->cty->size, sz);
+    emit("cmp %s, %s", reg(RAX, sz), reg(R11, sz));
+    emit("%s %s", jcc(cond->ty, if_true), label);
+    return;
+  }
+  }
+  gen(cond);
+  pop("rax");
+  emit("cmp rax, 0");
+  emit("%s %s", if_true ? "jne" : "je", label);
+}
+
 static void gen_logical(Node *node) {
   char *true_label = bb_label();
   char *false_label = bb_label();
@@ -148,21 +377,21 @@ static void gen_logical(Node *node) {
   switch (node->ty) {
   case ND_AND:
     gen(node->lhs);
-    emit("pop rax");
+    pop("rax");
     emit("cmp rax, 0");
     emit("je %s", false_label);
     gen(node->rhs);
-    emit("pop rax");
+    pop("rax");
     emit("cmp rax, 0");
     emit("je %s", false_label);
     break;
   case ND_OR:
     gen(node->lhs);
-    emit("pop rax");
+    pop("rax");
     emit("cmp rax, 0");
     emit("jne %s", true_label);
     gen(node->rhs);
-    emit("pop rax");
+    pop("rax");
     emit("cmp rax, 0");
     emit("jne %s", true_label);
     emit("jmp %s", false_label);
@@ -170,84 +399,172 @@ static void gen_logical(Node *node) {
   default:
     error("Unknown operator %d", node->ty);
   }
+  // Only one of the results is pushed.
   emit_label(true_label);
   emit("push 1");
   emit("jmp %s", last_label);
   emit_label(false_label);
-  emit("push 0");
+  push("0");
   emit_label(last_label);
 }
 
-static void gen_bitwise(Node *node) {
-  gen(node->lhs);
-  gen(node->rhs);
-  emit("pop r11");
-  emit("pop rax");
-  int sz = node->cty->size;
-  char *rax = reg(RAX, sz);
-  char *r11 = reg(R11, sz);
-  switch (node->ty) {
-  case '&':
-    emit("and %s, %s", rax, r11);
-    break;
-  case '|':
-    emit("or %s, %s", rax, r11);
-    break;
-  case '^':
-    emit("xor %s, %s", rax, r11);
-    break;
-  default:
-    error("Unknown operator %d", node->ty);
+/**
+ * A memory operand [base + index * scale + disp]. The base is either a
+ * variable, in the frame or a data section, or the value of a pointer
+ * expression.
+ */
+typedef struct {
+  Var *frame;
+  Node *base;
+  Node *index;
+  int scale;
+  int disp;
+} Addr;
+
+// Matches the address computed by node to the parts of a memory operand.
+static Addr match_addr(Node *node) {
+  Addr a = {.scale = 1};
+  if ((node->ty == '+' || node->ty == '-') && node->cty->ty == TY_PTR) {
+    // The offset has been scaled by conv().
+    Node *off = node->rhs;
+    if (off->ty == ND_NUM) {
+      a.disp = node->ty == '+' ? off->val : -off->val;
+      node = node->lhs;
+    } else if (node->ty == '+') {
+      if (off->ty == '*' && off->rhs->ty == ND_NUM &&
+          (off->rhs->val == 2 || off->rhs->val == 4 || off->rhs->val == 8)) {
+        a.index = off->lhs;
+        a.scale = off->rhs->val;
+      } else {
+        a.index = off;
+      }
+      // a[i + c]
+      Node *idx = a.index;
+      if ((idx->ty == '+' || idx->ty == '-') && idx->rhs->ty == ND_NUM) {
+        a.disp = (idx->ty == '+' ? idx->rhs->val : -idx->rhs->val) * a.scale;
+        a.index = idx->lhs;
+      }
+      node = node->lhs;
+    }
   }
-  emit_push(RAX, sz);
+  if (node->ty == ND_ADDR && node->expr->ty == ND_IDENT &&
+      !node->expr->var->has_address)
+    a.frame = node->expr->var;
+  else
+    a.base = node;
+  return a;
 }
 
-static void gen_shift(Node *node) {
-  gen(node->lhs);
-  gen(node->rhs);
-  emit("pop rcx");
-  emit("pop rax");
-  int sz = node->cty->size;
-  char *rax = reg(RAX, sz);
-  switch (node->ty) {
-  case ND_SHL:
-    emit("shl %s, cl", rax);
-    break;
-  case ND_SHR:
-    emit("shr %s, cl", rax);
-    break;
+// Returns the address of an lvalue as a memory operand.
+static Addr lval_addr(Node *node) {
+  if (node->ty == ND_DEREF)
+    return match_addr(node->expr);
+  if (node->ty != ND_IDENT)
+    error("Invalid lvalue %d.", node->ty);
+  if (node->var->reg)
+    error("Variable %s in a register has no address", node->var->name);
+  // The slot of an array parameter holds the address of the array.
+  if (node->var->has_address)
+    return match_addr(new_node_one(ND_ADDR, node));
+  Addr a = {.frame = node->var, .scale = 1};
+  return a;
+}
+
+// Returns true if node is a variable whose register can be used as a base
+// or index without loading it. Stores to 32-bit registers clear the upper
+// half, so an int index is sign-extended by pop_addr() first.
+static bool in_reg(Node *node) {
+  return node->ty == ND_IDENT && node->var->reg && node->cty->size >= 4;
+}
+
+// Pushes the parts of the address that are not in registers.
+static void push_addr(Addr *a) {
+  if (a->base && !in_reg(a->base))
+    gen(a->base);
+  if (a->index && !in_reg(a->index))
+    gen(a->index);
+}
+
+// Pops the parts pushed by push_addr() into rsi and rdi, and returns the
+// memory operand.
+static char *pop_addr(Addr *a) {
+  char *index = NULL;
+  if (a->index) {
+    bool full = a->index->cty->size == 8;
+    if (!in_reg(a->index)) {
+      pop("rdi");
+      if (!full)
+        emit("movsxd rdi, edi");
+      index = "rdi";
+    } else if (full) {
+      index = regs64[a->index->var->reg];
+    } else {
+      emit("movsxd rdi, %s", regs32[a->index->var->reg]);
+      index = "rdi";
+    }
   }
-  emit_push(RAX, sz);
+  char *base;
+  int disp = a->disp;
+  if (a->frame && a->frame->label && !index) {
+    base = format("rip + %s", a->frame->label);
+  } else if (a->frame && a->frame->label) {
+    // RIP-relative operands cannot have an index.
+    emit("lea rsi, [rip + %s]", a->frame->label);
+    base = "rsi";
+  } else if (a->frame) {
+    base = frame_base(&disp);
+    disp -= a->frame->offset;
+  } else if (in_reg(a->base)) {
+    base = regs64[a->base->var->reg];
+  } else {
+    pop("rsi");
+    base = "rsi";
+  }
+
+  char *s = base;
+  if (index && a->scale > 1)
+    s = format("%s + %s*%d", s, index, a->scale);
+  else if (index)
+    s = format("%s + %s", s, index);
+  if (disp > 0)
+    s = format("%s + %d", s, disp);
+  else if (disp < 0)
+    s = format("%s - %d", s, -disp);
+  return format("[%s]", s);
 }
 
 static void gen_lval(Node *node) {
-  if (node->ty == ND_DEREF) {
-    gen(node->expr);
+  if (node->ty == ND_IDENT && node->var->has_address) {
+    emit("mov rax, %s", frame_addr(-node->var->offset));
+    push("rax");
     return;
   }
-  if (node->ty == ND_IDENT) {
-    emit("lea rax, [rbp - %d]", node->var->offset);
-    emit("push rax");
-    if (node->var->has_address) {
-      emit("pop rax");
-      emit("mov rax, [rax]");
-      emit("push rax");
-    }
+  Addr a = lval_addr(node);
+  if (a.base && !a.index && !a.disp) {
+    gen(a.base);
     return;
   }
-  error("Invalid lvalue %d.", node->ty);
+  push_addr(&a);
+  emit("lea rax, %s", pop_addr(&a));
+  push("rax");
 }
 
 static void gen_postfix_incdec(Node *node) {
-  gen_lval(node->expr);
-  gen(node->expr);
-  emit("pop r11");
+  Var *var = node->expr->ty == ND_IDENT ? node->expr->var : NULL;
+  int sz = node->cty->size;
+  char *r11 = reg(R11, full_size(sz));
+  char *mem = NULL;
+  if (var && var->reg) {
+    emit("mov %s, %s", r11, reg(var->reg, full_size(sz)));
+  } else {
+    Addr a = lval_addr(node->expr);
+    push_addr(&a);
+    mem = pop_addr(&a);
+    emit_load(R11, mem, sz);
+  }
   // Save the value before postfix inc/dec into the register.
   emit("mov rcx, r11");
 
-  int sz = node->cty->size;
-  char *r11 = reg(R11, sz);
-
   switch (node->ty) {
   case ND_INC:
     emit("add %s, 1", r11);
@@ -258,229 +575,1362 @@ static void gen_postfix_incdec(Node *node) {
   default:
     error("Unknown node type %d", node->ty);
   }
-  emit("pop rax");
-  emit("mov [rax], %s", r11);
-  emit("push rcx");
+  if (mem)
+    emit("mov %s, %s", mem, reg(R11, sz));
+  else
+    emit_to_var(var, R11, sz);
+  push("rcx");
 }
 
 static void assign(Node *node) {
-  gen_lval(node->lhs);
-  gen(node->rhs);
-
-  emit("pop r11");
-  emit("pop rax");
-
+  Var *var = node->lhs->ty == ND_IDENT ? node->lhs->var : NULL;
   int sz = node->cty->size;
-  emit("mov [rax], %s", reg(R11, sz));
+  if (var && var->reg) {
+    gen(node->rhs);
+    pop("r11");
+    emit_widen(R11, node->rhs->cty->size, sz);
+    emit_to_var(var, R11, sz);
+    emit_push(R11, sz);
+    return;
+  }
+
+  Addr a = lval_addr(node->lhs);
+  push_addr(&a);
+  gen(node->rhs);
+  pop("r11");
+  emit_widen(R11, node->rhs->cty->size, sz);
+  emit("mov %s, %s", pop_addr(&a), reg(R11, sz));
   emit_push(R11, sz);
 }
 
-static void gen_param_lval(Node *node) {
-  assert(node->ty == ND_IDENT);
-  emit("lea rax, [rbp - %d]", node->var->offset);
-  emit("push rax");
+static void gen_opassign(Node *node) {
+  Addr a = lval_addr(node->lhs);
+  push_addr(&a);
+  gen(node->rhs);
+  pop("r11");
+  char *mem = pop_addr(&a);
+
+  // The operation is done in at least 32 bits, and the result is stored
+  // with the size of the lvalue.
+  int lsz = node->cty->size;
+  int sz = node->rhs->cty->size > lsz ? node->rhs->cty->size : lsz;
+  if (sz < 4)
+    sz = 4;
+  emit_load(RAX, mem, lsz);
+  emit_widen(RAX, lsz, sz);
+  emit_widen(R11, node->rhs->cty->size, sz);
+  if (is_div_const(node->op, node->rhs))
+    emit_div_const(node->op, node->rhs->val, sz);
+  else
+    emit_op(node->op, sz);
+  emit("mov %s, %s", mem, reg(RAX, lsz));
+  emit_push(RAX, lsz);
 }
 
+static int arg_regs[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+// Stores the parameters into their variables. Parameters after the sixth
+// are passed on the stack above the return address, and the saved rbp if
+// there is one.
 static void load_args(Node *func) {
+  int stack_args = frameless ? 8 : 16;
   for (int i = 0; i < func->params->len; i++) {
-    Node *param = func->params->data[i];
-    gen_param_lval(param);
-    switch (i) {
-    case 0:
-      emit("push rdi");
-      break;
-    case 1:
-      emit("push rsi");
-      break;
-    case 2:
-      emit("push rdx");
-      break;
-    case 3:
-      emit("push rcx");
-      break;
-    case 4:
-      emit("push r8");
-      break;
-    case 5:
-      emit("push r9");
-      break;
-    default:
-      error("Too many parameters");
-    }
-    int sz;
-    if (param->var->has_address)
-      sz = 8;
+    Var *var = ((Node *)func->params->data[i])->var;
+    int sz = var->has_address ? 8 : var->ty->size;
+    int r = var->reg ? var->reg : RAX;
+    if (i >= 6)
+      emit_load(r, frame_addr(stack_args + (i - 6) * 8), sz);
+    else if (var->reg)
+      emit_to_var(var, arg_regs[i], sz);
     else
-      sz = param->cty->size;
-    emit("pop r11");
-    emit("pop rax");
-    emit("mov [rax], %s", reg(R11, sz));
-    emit_push(R11, sz);
+      r = arg_regs[i];
+    if (!var->reg)
+      emit("mov %s, %s", frame_addr(-var->offset), reg(r, sz));
   }
 }
 
 static void gen_ident(Node *node) {
-  gen_lval(node);
-  emit("pop rax");
   int sz = node->cty->size;
-  emit("mov %s, [rax]", reg(RAX, sz));
-  emit_push(RAX, sz);
+  if (node->var->reg) {
+    emit("mov %s, %s", reg(RAX, full_size(sz)),
+         reg(node->var->reg, full_size(sz)));
+    push("rax");
+    return;
+  }
+  Addr a = lval_addr(node);
+  push_addr(&a);
+  emit_load(RAX, pop_addr(&a), sz);
+  push("rax");
 }
 
-static void store_args(Node *node) {
-  for (int i = 0; i < node->args->len; i++) {
-    Node *arg = node->args->data[i];
-    gen(arg);
-    emit("pop rax");
-    switch (i) {
-    case 0:
-      emit("mov rdi, rax");
-      break;
-    case 1:
-      emit("mov rsi, rax");
-      break;
-    case 2:
-      emit("mov rdx, rax");
-      break;
-    case 3:
-      emit("mov rcx, rax");
-      break;
-    case 4:
-      emit("mov r8, rax");
-      break;
-    case 5:
-      emit("mov r9, rax");
-      break;
-    default:
-      error("Too many arguments");
+// Returns true if the argument can be moved straight into its register.
+// It neither calls nor uses the stack.
+static bool is_simple_arg(Node *node) {
+  switch (node->ty) {
+  case ND_NUM:
+    return true;
+  case ND_IDENT:
+    return !node->var->has_address && node->var->ty->ty != TY_ARR;
+  case ND_ADDR:
+    return node->expr->ty == ND_IDENT && !node->expr->var->has_address &&
+           !node->expr->var->reg;
+  }
+  return false;
+}
+
+static void move_arg(Node *node, int r) {
+  int sz = node->cty->size;
+  switch (node->ty) {
+  case ND_NUM:
+    emit("mov %s, %d", reg(r, full_size(sz)), node->val);
+    return;
+  case ND_IDENT:
+    if (node->var->reg) {
+      emit("mov %s, %s", reg(r, full_size(sz)),
+           reg(node->var->reg, full_size(sz)));
+      return;
     }
+    Addr a = lval_addr(node);
+    emit_load(r, pop_addr(&a), sz);
+    return;
+  case ND_ADDR: {
+    Addr a = lval_addr(node->expr);
+    emit("lea %s, %s", reg(r, 8), pop_addr(&a));
+    return;
+  }
   }
 }
 
-static void emit_prologue(Node *func) {
-  emit("push rbp");
-  emit("mov rbp, rsp");
-  int off = 0; // Offset from rbp
-  for (int i = 0; i < func->func_vars->len; i++) {
-    Var *var = func->func_vars->data[i];
-    if (var->has_address) {
-      off += 8;
-      off = roundup(off, 8);
-    } else {
-      off += var->ty->size;
-      off = roundup(off, var->ty->align);
+// Functions of the program, or NULL if functions are generated one by one,
+// and the function being generated.
+static Map *defined_funcs;
+static Node *cur_func;
+
+// Label after the prologue of the current function.
+static char *body_label;
+
+// True if the frame of the current function may be referred to through a
+// pointer, so that it must live until the function returns.
+static bool frame_escapes;
+
+// A function defined elsewhere may be variadic, which needs al set to the
+// number of vector registers used.
+static bool maybe_variadic(char *name) {
+  if (strcmp(name, cur_func->name) == 0)
+    return false;
+  return defined_funcs == NULL || map_get(defined_funcs, name) == NULL;
+}
+
+/**
+ * Passes the arguments of a call with the System V calling convention, and
+ * returns the number of values to drop after the call. The arguments after
+ * the sixth are stored into an area reserved below rsp, padded so that rsp
+ * is aligned to 16 bytes at the call. Of the register arguments, those that
+ * need the stack are pushed and popped into their registers, and the simple
+ * ones are then moved directly into their registers.
+ *
+ * The arguments that are not simple are evaluated from left to right. cse()
+ * relies on this: a value computed in an argument may be kept in a
+ * temporary and read by the arguments after it.
+ */
+static int gen_args(Node *node) {
+  Vector *args = node->args;
+  int nstack = args->len > 6 ? args->len - 6 : 0;
+  int area = nstack + (depth + nstack) % 2;
+  if (area) {
+    emit("sub rsp, %d", area * 8);
+    depth += area;
+  }
+  int area_depth = depth;
+  for (int i = 0; i < args->len; i++) {
+    if (i < 6) {
+      if (!is_simple_arg(args->data[i]))
+        gen(args->data[i]);
+      continue;
     }
-    var->offset = off;
+    gen(args->data[i]);
+    pop("r11");
+    emit("mov [rsp + %d], r11", (depth - area_depth + i - 6) * 8);
   }
-  emit("sub rsp, %d", roundup(off, 16));
-  load_args(func);
+
+  int nregs = args->len < 6 ? args->len : 6;
+  for (int i = nregs - 1; i >= 0; i--)
+    if (!is_simple_arg(args->data[i]))
+      pop(regs64[arg_regs[i]]);
+  for (int i = 0; i < nregs; i++)
+    if (is_simple_arg(args->data[i]))
+      move_arg(args->data[i], arg_regs[i]);
+  return area;
 }
 
-static void emit_epilogue() {
-  emit("leave");
-  emit("ret");
+static void gen_call(Node *node) {
+  int drop = gen_args(node);
+  if (maybe_variadic(node->name))
+    emit("mov al, 0");
+  emit("call _%s", node->name);
+  if (drop) {
+    emit("add rsp, %d", drop * 8);
+    depth -= drop;
+  }
+  push("rax");
 }
 
-static void gen(Node *node) {
+// Callee-saved registers that hold local variables.
+static int var_regs[] = {RBX, R12, R13, R14, R15};
+
+// Offsets from rbp where the callee-saved registers used by the current
+// function are saved, or 0 if a register is not used.
+static int saved_regs[R15 + 1];
+
+static void count_uses(Node *node, int weight);
+
+static void count_all(Vector *nodes, int weight) {
+  for (int i = 0; i < nodes->len; i++)
+    count_uses(nodes->data[i], weight);
+}
+
+// Adds weight to the variables referenced in node. References in loops
+// weigh more.
+static void count_uses(Node *node, int weight) {
   if (node == NULL)
     return;
-
   switch (node->ty) {
   case ND_NUM:
-    emit("push %d", node->val);
-    return;
-  case ND_COMP_STMT:
-    for (int i = 0; i < node->stmts->len; i++) {
-      Node *stmt = node->stmts->data[i];
-      if (stmt->ty == ND_NULL)
-        continue;
-      gen(stmt);
-    }
-    break;
   case ND_NULL:
-    break;
+  case ND_CASE:
+  case ND_BREAK:
+    return;
   case ND_IDENT:
-    gen_ident(node);
-    break;
+    node->var->uses += weight;
+    return;
   case ND_CALL:
-    store_args(node);
-    emit("mov al, 0");
-    emit("call _%s", node->name);
-    emit("push rax");
-    break;
+    count_all(node->args, weight);
+    return;
+  case ND_COMP_STMT:
+    count_all(node->stmts, weight);
+    return;
+  case ND_INITS:
+    count_all(node->inits, weight);
+    return;
   case ND_ADDR:
-    gen_lval(node->expr);
-    break;
   case ND_DEREF:
-    gen(node->expr);
-    emit("pop rax");
-    emit("mov rax, [rax]");
-    emit("push rax");
-    break;
-  case ND_ROOT:
-    for (int i = 0; i < node->funcs->len; i++) {
-      Node *func = node->funcs->data[i];
-      emit_label(format("_%s", func->name));
-      emit_prologue(func);
-      gen(func->body);
-    }
-    break;
   case ND_RETURN:
-    gen(node->expr);
-    emit("pop rax");
-    emit_epilogue();
-    break;
-  case ND_IF: {
-    char *then_label = bb_label();
-    char *else_label = bb_label();
-    char *last_label = bb_label();
-    gen(node->cond);
-    emit("pop rax");
-    emit("cmp rax, 0");
-    emit("jz %s", else_label);
-    emit_label(then_label);
-    gen(node->then);
-    emit_label(else_label);
-    gen(node->els);
-    emit_label(last_label);
-    break;
+  case ND_INC:
+  case ND_DEC:
+    count_uses(node->expr, weight);
+    return;
+  case ND_IF:
+    count_uses(node->cond, weight);
+    count_uses(node->then, weight);
+    count_uses(node->els, weight);
+    return;
+  case ND_FOR:
+  case ND_VECTOR:
+    count_uses(node->init, weight);
+    weight = weight < (1 << 20) ? weight * 8 : weight;
+    count_uses(node->cond, weight);
+    count_uses(node->after, weight);
+    count_uses(node->body, weight);
+    return;
+  case ND_WHILE:
+    weight = weight < (1 << 20) ? weight * 8 : weight;
+    // fallthrough
+  case ND_SWITCH:
+  case ND_INLINE:
+    count_uses(node->cond, weight);
+    count_uses(node->body, weight);
+    return;
+  default:
+    count_uses(node->lhs, weight);
+    count_uses(node->rhs, weight);
   }
-  case ND_FOR: {
-    char *cond_label = bb_label();
-    char *last_label = bb_label();
-    gen(node->init);
-    emit_label(cond_label);
-    gen(node->cond);
-    emit("pop rax");
-    emit("cmp rax, 0");
-    emit("jz %s", last_label);
-    gen(node->body);
-    gen(node->after);
-    emit("jmp %s", cond_label);
-    emit_label(last_label);
+}
+
+static bool is_reg_candidate(Var *var) {
+  return !var->escaped && !var->has_address && var->ty->ty != TY_ARR &&
+         var->uses >= 3;
+}
+
+/**
+ * Keeps the most used variables whose addresses are never taken in
+ * callee-saved registers, which survive calls.
+ */
+static void assign_regs(Node *func) {
+  Vector *vars = func->func_vars;
+  for (int i = 0; i < vars->len; i++) {
+    Var *var = vars->data[i];
+    var->reg = 0;
+    var->uses = 0;
+  }
+  if (!reg_alloc)
+    return;
+
+  mark_escaped(func->body);
+  count_uses(func->body, 1);
+  for (int r = 0; r < sizeof(var_regs) / sizeof(var_regs[0]); r++) {
+    Var *best = NULL;
+    for (int i = 0; i < vars->len; i++) {
+      Var *var = vars->data[i];
+      if (!var->reg && is_reg_candidate(var) &&
+          (best == NULL || var->uses > best->uses))
+        best = var;
+    }
+    if (best == NULL)
+      return;
+    best->reg = var_regs[r];
+  }
+}
+
+static bool has_escaping_vars(Node *func) {
+  mark_escaped(func->body);
+  for (int i = 0; i < func->func_vars->len; i++) {
+    Var *var = func->func_vars->data[i];
+    if (var->escaped || (var->ty->ty == TY_ARR && !var->has_address))
+      return true;
+  }
+  return false;
+}
+
+static bool is_leaf(Node *func) {
+  Vector *calls = new_vec();
+  collect_calls(func->body, calls);
+  return calls->len == 0;
+}
+
+static bool is_stmt(Node *node);
+
+// The statements of the function are numbered in order while computing the
+// live ranges of the variables. An expression statement, including the
+// inlined bodies in it, is at a single position, so the variables in it
+// are live at the same time whatever the order of evaluation.
+static int live_pos;
+static bool in_expr;
+
+// A loop around the statement being numbered. The variables declared
+// outside of the loop and referenced in it are live in the whole loop, as
+// their values may be carried to the next iteration.
+typedef struct {
+  int start;
+  Vector *vars;
+} LiveLoop;
+
+static Vector *live_loops;
+
+// Pairs of a variable holding a pointer and a variable whose storage it
+// may point to. The storage lives as long as the pointer.
+static Vector *live_aliases;
+
+static void live_range(Node *node);
+
+static void touch(Var *var) {
+  if (var->label)
+    return;
+  if (live_pos < var->live_start)
+    var->live_start = live_pos;
+  if (live_pos > var->live_end)
+    var->live_end = live_pos;
+  if (var->loop_depth < live_loops->len) {
+    LiveLoop *l = live_loops->data[var->loop_depth];
+    if (l->start < var->live_start)
+      var->live_start = l->start;
+    vec_push(l->vars, var);
+  }
+}
+
+// Keeps the variable live in the whole function.
+static void pin(Var *var) {
+  if (var == NULL || var->label)
+    return;
+  var->live_start = 0;
+  var->live_end = INT_MAX;
+}
+
+// Returns the variable whose storage the pointer value of node may point
+// to, or that holds such a pointer, or NULL.
+static Var *pointee(Node *node) {
+  switch (node->ty) {
+  case ND_IDENT:
+    return node->cty->ty == TY_PTR ? node->var : NULL;
+  case ND_ADDR:
+    if (node->expr->ty == ND_IDENT)
+      return node->expr->var;
+    if (node->expr->ty == ND_DEREF)
+      return pointee(node->expr->expr);
+    return NULL;
+  case '+':
+  case '-':
+    return node->cty->ty == TY_PTR ? pointee(node->lhs) : NULL;
+  case '=':
+    return pointee(node->rhs);
+  case ND_OPASSIGN:
+    return pointee(node->lhs);
+  case ND_INC:
+  case ND_DEC:
+    return pointee(node->expr);
+  }
+  return NULL;
+}
+
+static void live_stmt(Node *node) {
+  if (node == NULL)
+    return;
+  if (in_expr || is_stmt(node)) {
+    if (!in_expr)
+      live_pos++;
+    live_range(node);
+    return;
+  }
+  live_pos++;
+  in_expr = true;
+  live_range(node);
+  in_expr = false;
+}
+
+static void live_loop(Node *node) {
+  LiveLoop *l = alloc(sizeof(LiveLoop));
+  // The position of the condition.
+  l->start = in_expr ? live_pos : live_pos + 1;
+  l->vars = new_vec();
+  vec_push(live_loops, l);
+  live_stmt(node->cond);
+  live_stmt(node->body);
+  if (node->ty == ND_FOR || node->ty == ND_VECTOR)
+    live_stmt(node->after);
+  vec_pop(live_loops);
+  for (int i = 0; i < l->vars->len; i++) {
+    Var *var = l->vars->data[i];
+    if (live_pos > var->live_end)
+      var->live_end = live_pos;
+  }
+}
+
+// Extends the live ranges of the variables referenced in node.
+static void live_range(Node *node) {
+  if (node == NULL)
+    return;
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_NULL:
+  case ND_CASE:
+  case ND_BREAK:
+    return;
+  case ND_IDENT:
+    touch(node->var);
+    return;
+  case ND_INITS:
+    touch(node->var);
+    for (int i = 0; i < node->inits->len; i++)
+      live_range(node->inits->data[i]);
+    return;
+  case ND_CALL:
+    // The callee may keep the pointers passed to it.
+    for (int i = 0; i < node->args->len; i++) {
+      live_range(node->args->data[i]);
+      pin(pointee(node->args->data[i]));
+    }
+    return;
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      live_stmt(node->stmts->data[i]);
+    return;
+  case ND_IF:
+    live_stmt(node->cond);
+    live_stmt(node->then);
+    live_stmt(node->els);
+    return;
+  case ND_FOR:
+  case ND_VECTOR:
+    live_stmt(node->init);
+    live_loop(node);
+    return;
+  case ND_WHILE:
+    live_loop(node);
+    return;
+  case ND_SWITCH:
+    live_stmt(node->cond);
+    live_stmt(node->body);
+    return;
+  case ND_INLINE:
+    live_stmt(node->body);
+    return;
+  case ND_RETURN:
+    // An inlined body returns the pointer to its caller.
+    live_range(node->expr);
+    pin(pointee(node->expr));
+    return;
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_INC:
+  case ND_DEC:
+    live_range(node->expr);
+    return;
+  case '=': {
+    live_range(node->lhs);
+    live_range(node->rhs);
+    Var *var = pointee(node->rhs);
+    if (var == NULL)
+      return;
+    if (node->lhs->ty == ND_IDENT && !node->lhs->var->label) {
+      vec_push(live_aliases, node->lhs->var);
+      vec_push(live_aliases, var);
+    } else {
+      pin(var);
+    }
+    return;
+  }
+  default:
+    live_range(node->lhs);
+    live_range(node->rhs);
+  }
+}
+
+// Computes the live range of each variable in the frame of the function.
+static void live_ranges(Node *func) {
+  for (int i = 0; i < func->func_vars->len; i++) {
+    Var *var = func->func_vars->data[i];
+    var->live_start = INT_MAX;
+    var->live_end = -1;
+    if (var->escaped)
+      pin(var);
+  }
+  live_pos = 0;
+  in_expr = false;
+  live_loops = new_vec();
+  live_aliases = new_vec();
+  // The parameters are stored on entry.
+  for (int i = 0; i < func->params->len; i++)
+    touch(((Node *)func->params->data[i])->var);
+  live_stmt(func->body);
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < live_aliases->len; i += 2) {
+      Var *ptr = live_aliases->data[i];
+      Var *var = live_aliases->data[i + 1];
+      if (ptr->live_start < var->live_start) {
+        var->live_start = ptr->live_start;
+        changed = true;
+      }
+      if (ptr->live_end > var->live_end) {
+        var->live_end = ptr->live_end;
+        changed = true;
+      }
+    }
+  }
+}
+
+// A stack slot shared by variables whose live ranges do not overlap.
+typedef struct {
+  int size;
+  int align;
+  int end; // the end of the last live range in the slot
+  int offset;
+} Slot;
+
+static int slot_size(Var *var) { return var->has_address ? 8 : var->ty->size; }
+
+static int slot_align(Var *var) {
+  return var->has_address ? 8 : var->ty->align;
+}
+
+// Orders variables by the start of their live ranges, and then by their
+// index in the function, which is in the offset for now.
+static int cmp_live_start(const void *p, const void *q) {
+  Var *a = *(Var **)p;
+  Var *b = *(Var **)q;
+  if (a->live_start != b->live_start)
+    return a->live_start < b->live_start ? -1 : 1;
+  return a->offset - b->offset;
+}
+
+/**
+ * Assigns the offsets of the variables in the frame and returns the size of
+ * the variables. Variables whose live ranges do not overlap share a slot,
+ * which grows to the largest size and alignment of them. The slots are laid
+ * out by decreasing alignment so that there is no padding between them.
+ */
+static int color_slots(Node *func) {
+  live_ranges(func);
+  Vector *vars = new_vec();
+  for (int i = 0; i < func->func_vars->len; i++) {
+    Var *var = func->func_vars->data[i];
+    if (var->reg)
+      continue;
+    var->offset = i;
+    vec_push(vars, var);
+  }
+  qsort(vars->data, vars->len, sizeof(void *), cmp_live_start);
+
+  // Linear scan over the live ranges. A variable takes the smallest free
+  // slot large enough for it, or else grows the largest one.
+  Vector *slots = new_vec();
+  Vector *slot_of = new_vec();
+  for (int i = 0; i < vars->len; i++) {
+    Var *var = vars->data[i];
+    int size = slot_size(var);
+    Slot *best = NULL;
+    for (int j = 0; j < slots->len; j++) {
+      Slot *s = slots->data[j];
+      if (s->end >= var->live_start)
+        continue;
+      if (best == NULL || (best->size < size && s->size > best->size) ||
+          (s->size >= size && s->size < best->size))
+        best = s;
+    }
+    if (best == NULL) {
+      best = alloc(sizeof(Slot));
+      best->end = -1;
+      vec_push(slots, best);
+    }
+    if (size > best->size)
+      best->size = size;
+    if (slot_align(var) > best->align)
+      best->align = slot_align(var);
+    if (var->live_end > best->end)
+      best->end = var->live_end;
+    vec_push(slot_of, best);
+  }
+
+  int off = 0;
+  for (int align = 8; align > 0; align /= 2) {
+    for (int i = 0; i < slots->len; i++) {
+      Slot *s = slots->data[i];
+      if (s->align != align)
+        continue;
+      off = roundup(off + s->size, align);
+      s->offset = off;
+    }
+  }
+  for (int i = 0; i < vars->len; i++)
+    ((Var *)vars->data[i])->offset = ((Slot *)slot_of->data[i])->offset;
+  return off;
+}
+
+// Gives every variable its own slot in the order of declaration, and
+// returns the size of the variables.
+static int assign_slots(Node *func, bool assign) {
+  int off = 0;
+  for (int i = 0; i < func->func_vars->len; i++) {
+    Var *var = func->func_vars->data[i];
+    if (var->reg)
+      continue;
+    off = roundup(off + slot_size(var), slot_align(var));
+    if (assign)
+      var->offset = off;
+  }
+  return off;
+}
+
+static void emit_prologue(Node *func) {
+  assign_regs(func);
+  int off; // Offset from rbp
+  if (stack_coloring)
+    off = color_slots(func);
+  else
+    off = assign_slots(func, true);
+  if (frame_report)
+    fprintf(stderr, "%s: %d bytes of variables, %d without sharing slots\n",
+            func->name, off, assign_slots(func, false));
+  for (int i = 0; i < sizeof(var_regs) / sizeof(var_regs[0]); i++)
+    saved_regs[var_regs[i]] = 0;
+  for (int i = 0; i < func->func_vars->len; i++) {
+    Var *var = func->func_vars->data[i];
+    if (var->reg) {
+      off = roundup(off + 8, 8);
+      saved_regs[var->reg] = off;
+    }
+  }
+
+  // Only calls need rsp aligned to 16 bytes. A function without a frame
+  // has no prologue at all.
+  frameless = omit_frame && is_leaf(func);
+  depth = 0;
+  if (frameless) {
+    frame_size = roundup(off, 8);
+    if (frame_size)
+      emit("sub rsp, %d", frame_size);
+  } else {
+    emit("push rbp");
+    emit("mov rbp, rsp");
+    if (off)
+      emit("sub rsp, %d", roundup(off, 16));
+  }
+  for (int i = 0; i < sizeof(var_regs) / sizeof(var_regs[0]); i++) {
+    int r = var_regs[i];
+    if (saved_regs[r])
+      emit("mov %s, %s", frame_addr(-saved_regs[r]), reg(r, 8));
+  }
+  load_args(func);
+  frame_escapes = has_escaping_vars(func);
+  body_label = bb_label();
+  emit_label(body_label);
+}
+
+// Restores the callee-saved registers and rsp to the values on entry.
+static void emit_teardown() {
+  for (int i = 0; i < sizeof(var_regs) / sizeof(var_regs[0]); i++) {
+    int r = var_regs[i];
+    if (saved_regs[r])
+      emit("mov %s, %s", reg(r, 8), frame_addr(-saved_regs[r]));
+  }
+  if (!frameless)
+    emit("leave");
+  else if (frame_size + depth * 8)
+    emit("add rsp, %d", frame_size + depth * 8);
+}
+
+static void emit_epilogue() {
+  emit_teardown();
+  emit("ret");
+}
+
+static bool is_self_call(Node *node) {
+  return strcmp(node->name, cur_func->name) == 0 &&
+         node->args->len == cur_func->params->len;
+}
+
+// Returns true if the value of the call is returned by the current
+// function as is, and the call can replace it.
+static bool is_tail_call(Node *node) {
+  if (!tail_calls || node->ty != ND_CALL || inline_end || depth)
+    return false;
+  if (frame_escapes)
+    return false;
+  return is_self_call(node) || node->args->len <= 6;
+}
+
+/**
+ * Generates a call in tail position. A call of the function itself
+ * assigns the arguments to the parameters and jumps back to the start of
+ * the body, so the recursion becomes a loop. Other calls tear down the
+ * frame and jump to the callee, which returns to our caller.
+ */
+static void gen_tail_call(Node *node) {
+  if (is_self_call(node)) {
+    for (int i = 0; i < node->args->len; i++)
+      gen(node->args->data[i]);
+    for (int i = node->args->len - 1; i >= 0; i--) {
+      Var *var = ((Node *)cur_func->params->data[i])->var;
+      int sz = var->has_address ? 8 : var->ty->size;
+      pop("r11");
+      if (var->reg)
+        emit_to_var(var, R11, sz);
+      else
+        emit("mov %s, %s", frame_addr(-var->offset), reg(R11, sz));
+    }
+    emit("jmp %s", body_label);
+    return;
+  }
+  gen_args(node);
+  emit_teardown();
+  if (maybe_variadic(node->name))
+    emit("mov al, 0");
+  emit("jmp _%s", node->name);
+}
+
+static int cmp_case(const void *a, const void *b) {
+  int x = (*(Node **)a)->cond->val;
+  int y = (*(Node **)b)->cond->val;
+  return x < y ? -1 : x > y;
+}
+
+// Compares rax with the cases [lo, hi), which are sorted by value, by a
+// balanced binary search down to a few cases that are compared in turn.
+static void emit_case_tree(Vector *cases, int lo, int hi, char *dflt,
+                           int sz) {
+  if (hi - lo <= SWITCH_LINEAR_CASES) {
+    for (int i = lo; i < hi; i++) {
+      Node *c = cases->data[i];
+      emit("cmp %s, %d", reg(RAX, sz), c->cond->val);
+      emit("je %s", c->name);
+    }
+    emit("jmp %s", dflt);
+    return;
+  }
+  int mid = lo + (hi - lo) / 2;
+  Node *c = cases->data[mid];
+  char *upper = bb_label();
+  emit("cmp %s, %d", reg(RAX, sz), c->cond->val);
+  emit("je %s", c->name);
+  emit("jg %s", upper);
+  emit_case_tree(cases, lo, mid, dflt, sz);
+  emit_label(upper);
+  emit_case_tree(cases, mid + 1, hi, dflt, sz);
+}
+
+static bool is_dense(Vector *cases) {
+  if (!jump_tables || cases->len <= SWITCH_LINEAR_CASES)
+    return false;
+  long min = ((Node *)cases->data[0])->cond->val;
+  long max = ((Node *)cases->data[cases->len - 1])->cond->val;
+  return max - min + 1 <= (long)cases->len * JUMP_TABLE_DENSITY;
+}
+
+// Jumps through a table in .rodata indexed by rax minus the smallest case.
+// The entries are offsets from the table, so they need no relocation.
+static void emit_jump_table(Vector *cases, char *dflt, int sz) {
+  int min = ((Node *)cases->data[0])->cond->val;
+  int max = ((Node *)cases->data[cases->len - 1])->cond->val;
+  char *table = bb_label();
+  // Writing eax also clears the upper half of rax, which is the index.
+  emit("sub %s, %d", reg(RAX, sz), min);
+  emit("cmp %s, %d", reg(RAX, sz), max - min);
+  emit("ja %s", dflt);
+  emit("lea r11, [rip + %s]", table);
+  emit("movsxd rax, dword ptr [r11 + rax * 4]");
+  emit("add rax, r11");
+  emit("jmp rax");
+
+  emit_directive(RODATA_SECTION);
+  emit_directive("p2align 2");
+  emit_label(table);
+  for (int i = 0, v = min; i < cases->len; v++) {
+    Node *c = cases->data[i];
+    if (c->cond->val == v) {
+      emit(".long %s - %s", c->name, table);
+      i++;
+    } else {
+      emit(".long %s - %s", dflt, table);
+    }
+  }
+  emit_directive("previous");
+}
+
+/**
+ * Generates a switch statement. The value is dispatched to the case labels
+ * by a jump table if the cases are dense, and by comparisons otherwise. The
+ * labels are among the statements of the body, which is generated as is.
+ */
+static void gen_switch(Node *node) {
+  char *outer_break = break_label;
+  break_label = bb_label();
+  Vector *cases = new_vec();
+  char *dflt = break_label;
+  Vector *stmts = node->body->stmts;
+  for (int i = 0; i < stmts->len; i++) {
+    Node *c = stmts->data[i];
+    if (c->ty != ND_CASE)
+      continue;
+    c->name = bb_label();
+    if (c->cond)
+      vec_push(cases, c);
+    else
+      dflt = c->name;
+  }
+  qsort(cases->data, cases->len, sizeof(void *), cmp_case);
+
+  if (node->cond->ty == ND_NUM) {
+    char *target = dflt;
+    for (int i = 0; i < cases->len; i++) {
+      Node *c = cases->data[i];
+      if (c->cond->val == node->cond->val)
+        target = c->name;
+    }
+    emit("jmp %s", target);
+  } else {
+    gen(node->cond);
+    pop("rax");
+    int sz = full_size(node->cond->cty->size);
+    if (is_dense(cases))
+      emit_jump_table(cases, dflt, sz);
+    else
+      emit_case_tree(cases, 0, cases->len, dflt, sz);
+  }
+
+  gen(node->body);
+  emit_label(break_label);
+  break_label = outer_break;
+}
+
+static char *ptr_size(int size) {
+  if (size == 1)
+    return "byte ptr";
+  if (size == 4)
+    return "dword ptr";
+  return "qword ptr";
+}
+
+static char *data_directive(int size) {
+  if (size == 1)
+    return ".byte";
+  if (size == 4)
+    return ".long";
+  return ".quad";
+}
+
+// Returns the value stored to an element of the size. Chars are signed.
+static int elem_val(int val, int size) {
+  return size == 1 ? (signed char)val : val;
+}
+
+// Returns the directive aligning an element of the given size.
+static char *p2align(int size) {
+  return format("p2align %d", size == 8 ? 3 : size == 4 ? 2 : 0);
+}
+
+/**
+ * Initializes a local array. The constant elements of a large initializer
+ * are copied from an image in .rodata, and those of a small one are stored
+ * as immediates. The elements past the initializer are zero-filled. The
+ * initializer has an assignment per element, in order.
+ */
+static void gen_inits(Node *node) {
+  Var *var = node->var;
+  if (var->ty->ty != TY_ARR)
+    error("Unsupported type for initialization %d", var->ty);
+  Vector *inits = node->inits;
+  int size = var->ty->arr_of->size;
+  Vector *rest = new_vec();
+
+  if (inits->len * size >= BULK_INIT_SIZE) {
+    char *image = bb_label();
+    emit_directive(RODATA_SECTION);
+    emit_directive(p2align(size));
+    emit_label(image);
+    for (int i = 0; i < inits->len; i++) {
+      Node *init = inits->data[i];
+      bool is_const = init->ty == '=' && init->rhs->ty == ND_NUM;
+      emit("%s %d", data_directive(size),
+           is_const ? elem_val(init->rhs->val, size) : 0);
+      if (!is_const)
+        vec_push(rest, init);
+    }
+    emit_directive("previous");
+    emit("lea rdi, %s", frame_addr(-var->offset));
+    emit("lea rsi, [rip + %s]", image);
+    emit("mov ecx, %d", inits->len * size);
+    emit("rep movsb");
+  } else {
+    for (int i = 0; i < inits->len; i++) {
+      Node *init = inits->data[i];
+      if (init->ty == '=' && init->rhs->ty == ND_NUM)
+        emit("mov %s %s, %d", ptr_size(size),
+             frame_addr(-var->offset + i * size),
+             elem_val(init->rhs->val, size));
+      else
+        vec_push(rest, init);
+    }
+  }
+  for (int i = 0; i < rest->len; i++)
+    gen_stmt(rest->data[i]);
+
+  int start = -var->offset + inits->len * size;
+  int fill = (var->ty->len - inits->len) * size;
+  if (fill >= BULK_INIT_SIZE) {
+    emit("lea rdi, %s", frame_addr(start));
+    emit("xor eax, eax");
+    emit("mov ecx, %d", fill);
+    emit("rep stosb");
+    return;
+  }
+  for (int off = 0; off < fill; off += size)
+    emit("mov %s %s, 0", ptr_size(size), frame_addr(start + off));
+}
+
+/**
+ * The arrays and invariant operands of a vectorized loop. While it runs,
+ * the addresses of the arrays are in base_regs, the index in rax, the bound
+ * in rcx, and the invariants are broadcast to xmm8 and up. The elements are
+ * computed in xmm0 to xmm7.
+ */
+typedef struct {
+  int size; // of the elements
+  Vector *bases;
+  Vector *stored; // bool for each base
+  Vector *invariants;
+} VecLoop;
+
+static int base_regs[] = {R8, R9, R10, RDX, RSI, RDI};
+
+static Var *base_var(Node *base) {
+  return base->ty == ND_ADDR ? base->expr->var : base->var;
+}
+
+static int find_base(VecLoop *v, Node *base) {
+  for (int i = 0; i < v->bases->len; i++)
+    if (base_var(v->bases->data[i]) == base_var(base))
+      return i;
+  vec_push(v->bases, base);
+  vec_push(v->stored, (void *)false);
+  return v->bases->len - 1;
+}
+
+static int find_invariant(VecLoop *v, Node *node) {
+  for (int i = 0; i < v->invariants->len; i++) {
+    Node *inv = v->invariants->data[i];
+    if (inv->ty == node->ty &&
+        (node->ty == ND_NUM ? inv->val == node->val : inv->var == node->var))
+      return i;
+  }
+  vec_push(v->invariants, node);
+  return v->invariants->len - 1;
+}
+
+// Finds the arrays and invariants of the loop body, in evaluation order.
+static void collect_vector(VecLoop *v, Node *node) {
+  switch (node->ty) {
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      collect_vector(v, node->stmts->data[i]);
+    return;
+  case '=': {
+    collect_vector(v, node->rhs);
+    int k = find_base(v, node->lhs->expr->lhs);
+    v->stored->data[k] = (void *)true;
+    return;
+  }
+  case ND_DEREF:
+    find_base(v, node->expr->lhs);
+    return;
+  case ND_NUM:
+  case ND_IDENT:
+    find_invariant(v, node);
+    return;
+  case ND_SHL:
+  case ND_SHR:
+    collect_vector(v, node->lhs);
+    return;
+  default:
+    collect_vector(v, node->lhs);
+    collect_vector(v, node->rhs);
+  }
+}
+
+// Returns the elements at index rax of the array addressed by node.
+static char *vector_elem(VecLoop *v, Node *node) {
+  int r = base_regs[find_base(v, node->lhs)];
+  return format("[%s + rax*%d]", regs64[r], v->size);
+}
+
+static char vector_suffix(int size) {
+  return size == 1 ? 'b' : size == 4 ? 'd' : 'q';
+}
+
+// Computes the elements of node into xmm d, using the registers above it
+// for the operands.
+static void gen_vector_expr(VecLoop *v, Node *node, int d) {
+  char sfx = vector_suffix(v->size);
+  switch (node->ty) {
+  case ND_NUM:
+  case ND_IDENT:
+    emit("movdqa xmm%d, xmm%d", d, 8 + find_invariant(v, node));
+    return;
+  case ND_DEREF:
+    emit("movdqu xmm%d, %s", d, vector_elem(v, node->expr));
+    return;
+  case ND_SHL:
+  case ND_SHR:
+    gen_vector_expr(v, node->lhs, d);
+    emit("%s%c xmm%d, %d", node->ty == ND_SHL ? "psll" : "psrl", sfx, d,
+         node->rhs->val);
+    return;
+  }
+
+  gen_vector_expr(v, node->lhs, d);
+  int rhs = d + 1;
+  if (node->rhs->ty == ND_NUM || node->rhs->ty == ND_IDENT)
+    rhs = 8 + find_invariant(v, node->rhs);
+  else
+    gen_vector_expr(v, node->rhs, rhs);
+  switch (node->ty) {
+  case '+':
+    emit("padd%c xmm%d, xmm%d", sfx, d, rhs);
+    return;
+  case '-':
+    emit("psub%c xmm%d, xmm%d", sfx, d, rhs);
+    return;
+  case '&':
+    emit("pand xmm%d, xmm%d", d, rhs);
+    return;
+  case '|':
+    emit("por xmm%d, xmm%d", d, rhs);
+    return;
+  case '^':
+    emit("pxor xmm%d, xmm%d", d, rhs);
+    return;
+  }
+  error("Unsupported vector operator %d", node->ty);
+}
+
+// Copies the value in r11 to every element of xmm8 + k.
+static void broadcast(VecLoop *v, int k) {
+  int x = 8 + k;
+  if (v->size == 8) {
+    emit("movq xmm%d, r11", x);
+    emit("punpcklqdq xmm%d, xmm%d", x, x);
+    return;
+  }
+  if (v->size == 1) {
+    emit("movzx r11d, r11b");
+    emit("imul r11d, r11d, 0x01010101");
+  }
+  emit("movd xmm%d, r11d", x);
+  emit("pshufd xmm%d, xmm%d, 0", x, x);
+}
+
+// Returns true if the arrays of bases i and j are different objects.
+static bool distinct_arrays(VecLoop *v, int i, int j) {
+  Node *x = v->bases->data[i];
+  Node *y = v->bases->data[j];
+  return x->ty == ND_ADDR && y->ty == ND_ADDR &&
+         !base_var(x)->has_address && !base_var(y)->has_address;
+}
+
+/**
+ * Generates a vectorized loop (see vectorize_loop() in loop.c). The loop
+ * only runs if no element it stores is loaded or stored by another lane of
+ * the same group: the distance between an array stored to and any other
+ * array must be 0 or at least VECTOR_SIZE bytes, or the original loop runs
+ * all the iterations.
+ */
+static void gen_vector(Node *node) {
+  VecLoop v = {.bases = new_vec(), .stored = new_vec(),
+               .invariants = new_vec()};
+  Node *body = node->body;
+  Vector *stmts = body->ty == ND_COMP_STMT ? body->stmts : NULL;
+  Node *first = stmts ? stmts->data[0] : body;
+  v.size = first->cty->size;
+  collect_vector(&v, body);
+
+  for (int i = 0; i < v.bases->len; i++)
+    gen(v.bases->data[i]);
+  for (int i = 0; i < v.invariants->len; i++)
+    if (((Node *)v.invariants->data[i])->ty == ND_IDENT)
+      gen(v.invariants->data[i]);
+  Node *idx = node->cond->lhs;
+  Node *n = node->cond->rhs;
+  gen(idx);
+  gen(n);
+  pop("rcx");
+  pop("rax");
+  if (n->cty->size <= 4)
+    emit("movsxd rcx, ecx");
+  if (idx->cty->size == 4)
+    emit("movsxd rax, eax");
+  for (int i = v.invariants->len - 1; i >= 0; i--) {
+    Node *inv = v.invariants->data[i];
+    if (inv->ty == ND_IDENT)
+      pop("r11");
+    else
+      emit("mov r11, %d", inv->val);
+    broadcast(&v, i);
+  }
+  for (int i = v.bases->len - 1; i >= 0; i--)
+    pop(regs64[base_regs[i]]);
+
+  char *skip_label = bb_label();
+  for (int i = 0; i < v.bases->len; i++) {
+    if (!v.stored->data[i])
+      continue;
+    for (int j = 0; j < v.bases->len; j++) {
+      if (j == i || (j < i && v.stored->data[j]) || distinct_arrays(&v, i, j))
+        continue;
+      char *ok_label = bb_label();
+      emit("mov r11, %s", regs64[base_regs[i]]);
+      emit("sub r11, %s", regs64[base_regs[j]]);
+      emit("je %s", ok_label);
+      emit("cmp r11, -%d", VECTOR_SIZE);
+      emit("jle %s", ok_label);
+      emit("cmp r11, %d", VECTOR_SIZE);
+      emit("jl %s", skip_label);
+      emit_label(ok_label);
+    }
+  }
+
+  // The last element of a group is at rax + lanes - 1 < rcx.
+  int lanes = VECTOR_SIZE / v.size;
+  char *body_label = bb_label();
+  char *last_label = bb_label();
+  emit("lea r11, [rax + %d]", lanes);
+  emit("cmp r11, rcx");
+  emit("jg %s", last_label);
+  emit_label(body_label);
+  for (int i = 0; i < (stmts ? stmts->len : 1); i++) {
+    Node *stmt = stmts ? stmts->data[i] : body;
+    gen_vector_expr(&v, stmt->rhs, 0);
+    emit("movdqu %s, xmm0", vector_elem(&v, stmt->lhs->expr));
+  }
+  emit("add rax, %d", lanes);
+  emit("lea r11, [rax + %d]", lanes);
+  emit("cmp r11, rcx");
+  emit("jle %s", body_label);
+  emit_label(last_label);
+
+  int sz = idx->cty->size;
+  if (idx->var->reg) {
+    emit_to_var(idx->var, RAX, sz);
+  } else {
+    Addr a = lval_addr(idx);
+    push_addr(&a);
+    emit("mov %s, %s", pop_addr(&a), reg(RAX, sz));
+  }
+  emit_label(skip_label);
+}
+
+static bool is_stmt(Node *node) {
+  switch (node->ty) {
+  case ND_COMP_STMT:
+  case ND_RETURN:
+  case ND_IF:
+  case ND_FOR:
+  case ND_VECTOR:
+  case ND_WHILE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_BREAK:
+  case ND_INITS:
+  case ND_NULL:
+    return true;
+  }
+  return false;
+}
+
+// Generates a statement. The value of an expression statement is popped.
+static void gen_stmt(Node *node) {
+  if (node == NULL)
+    return;
+  gen(node);
+  if (!is_stmt(node)) {
+    emit("add rsp, 8");
+    depth--;
+  }
+}
+
+static void gen(Node *node) {
+  if (node == NULL)
+    return;
+
+  switch (node->ty) {
+  case ND_NUM:
+    emit("push %d", node->val);
+    depth++;
+    return;
+  case ND_COMP_STMT:
+    for (int i = 0; i < node->stmts->len; i++)
+      gen_stmt(node->stmts->data[i]);
+    break;
+  case ND_NULL:
+    break;
+  case ND_IDENT:
+    gen_ident(node);
+    break;
+  case ND_CALL:
+    gen_call(node);
+    break;
+  case ND_ADDR:
+    gen_lval(node->expr);
+    break;
+  case ND_DEREF: {
+    Addr a = match_addr(node->expr);
+    push_addr(&a);
+    emit_load(RAX, pop_addr(&a), node->cty->size);
+    push("rax");
+    break;
+  }
+  case ND_ROOT: {
+    defined_funcs = new_map();
+    for (int i = 0; i < node->funcs->len; i++) {
+      Node *func = node->funcs->data[i];
+      map_set(defined_funcs, func->name, func);
+    }
+    bool in_cold = false;
+    for (int i = 0; i < node->funcs->len; i++) {
+      Node *func = node->funcs->data[i];
+      if (cold_section && func->cold && !in_cold) {
+        emit_directive(COLD_SECTION);
+        in_cold = true;
+      }
+      gen_x64_func(func);
+    }
+    gen_x64_globals(node->globals);
+    break;
+  }
+  case ND_RETURN:
+    if (is_tail_call(node->expr)) {
+      gen_tail_call(node->expr);
+      break;
+    }
+    gen(node->expr);
+    pop("rax");
+    if (inline_end) {
+      if (depth > inline_depth)
+        emit("add rsp, %d", (depth - inline_depth) * 8);
+      emit("jmp %s", inline_end);
+    }
+    else
+      emit_epilogue();
+    break;
+  case ND_INLINE: {
+    // Returns drop whatever the body has pushed and jump to the end.
+    char *outer_end = inline_end;
+    int outer_depth = inline_depth;
+    inline_end = bb_label();
+    inline_depth = depth;
+    gen(node->body);
+    emit_label(inline_end);
+    depth = inline_depth;
+    push("rax");
+    inline_end = outer_end;
+    inline_depth = outer_depth;
+    break;
+  }
+  case ND_IF: {
+    char *else_label = bb_label();
+    gen_branch(node->cond, else_label, false);
+    gen_stmt(node->then);
+    if (node->els == NULL) {
+      emit_label(else_label);
+      break;
+    }
+    char *last_label = bb_label();
+    emit("jmp %s", last_label);
+    emit_label(else_label);
+    gen_stmt(node->els);
+    emit_label(last_label);
+    break;
+  }
+  case ND_FOR: {
+    // Loops are rotated: the condition is tested once before the loop and
+    // then at the bottom of each iteration.
+    char *body_label = bb_label();
+    char *last_label = bb_label();
+    gen_stmt(node->init);
+    if (node->cond)
+      gen_branch(node->cond, last_label, false);
+    emit_label(body_label);
+    gen_stmt(node->body);
+    gen_stmt(node->after);
+    if (node->cond)
+      gen_branch(node->cond, body_label, true);
+    else
+      emit("jmp %s", body_label);
+    emit_label(last_label);
     break;
   }
   case ND_WHILE: {
-    char *cond_label = bb_label();
+    char *body_label = bb_label();
     char *last_label = bb_label();
-    emit_label(cond_label);
-    gen(node->cond);
-    emit("pop rax");
-    emit("cmp rax, 0");
-    emit("jz %s", last_label);
-    gen(node->body);
-    emit("jmp %s", cond_label);
+    gen_branch(node->cond, last_label, false);
+    emit_label(body_label);
+    gen_stmt(node->body);
+    gen_branch(node->cond, body_label, true);
     emit_label(last_label);
     break;
   }
+  case ND_SWITCH:
+    gen_switch(node);
+    break;
+  case ND_CASE:
+    emit_label(node->name);
+    break;
+  case ND_BREAK:
+    emit("jmp %s", break_label);
+    break;
   case ND_INITS:
-    if (node->var->ty->ty != TY_ARR)
-      error("Unsupported type for initialization %d", node->var->ty);
-    Node *init;
-    for (int i = 0; i < node->inits->len; i++) {
-      init = node->inits->data[i];
-      gen(init);
-    }
+    gen_inits(node);
+    break;
+  case ND_VECTOR:
+    gen_vector(node);
     break;
   case ND_EQ:
   case ND_NEQ:
@@ -491,26 +1941,25 @@ static void gen(Node *node) {
   case '=':
     assign(node);
     break;
+  case ND_OPASSIGN:
+    gen_opassign(node);
+    break;
   case '+':
   case '-':
   case '*':
   case '/':
   case '%':
-    gen_binary(node);
-    break;
+  case '&':
+  case '|':
+  case '^':
   case ND_SHL:
   case ND_SHR:
-    gen_shift(node);
+    gen_binary(node);
     break;
   case ND_AND:
   case ND_OR:
     gen_logical(node);
     break;
-  case '&':
-  case '|':
-  case '^':
-    gen_bitwise(node);
-    break;
   case ND_INC:
   case ND_DEC:
     gen_postfix_incdec(node);
@@ -520,9 +1969,49 @@ static void gen(Node *node) {
   }
 }
 
-void gen_x64(Node *node) {
+void gen_x64_header() {
   emit_directive("intel_syntax noprefix");
   emit_directive("global _main");
+}
 
+void gen_x64_func(Node *func) {
+  cur_func = func;
+  emit_label(format("_%s", func->name));
+  emit_prologue(func);
+  gen(func->body);
+
+  // Do not fall through into the next function.
+  Vector *stmts = func->body->stmts;
+  if (stmts->len == 0 || ((Node *)stmts->data[stmts->len - 1])->ty != ND_RETURN)
+    emit_epilogue();
+}
+
+/**
+ * Emits the global variables. Initialized ones are in .data, with the
+ * elements past the initializer zero-filled, and the others in .bss.
+ */
+void gen_x64_globals(Vector *globals) {
+  for (int i = 0; i < globals->len; i++) {
+    Var *var = globals->data[i];
+    Type *elem = var->ty;
+    while (elem->ty == TY_ARR)
+      elem = elem->arr_of;
+    emit_directive(var->init ? "data" : "bss");
+    emit_directive(p2align(elem->size));
+    emit_label(var->label);
+    int len = var->init ? var->init->len : 0;
+    if (len * elem->size > var->ty->size)
+      error("Too many initializers for %s", var->name);
+    for (int j = 0; j < len; j++)
+      emit("%s %d", data_directive(elem->size),
+           elem_val((intptr_t)var->init->data[j], elem->size));
+    if (var->ty->size > len * elem->size)
+      emit(".zero %d", var->ty->size - len * elem->size);
+  }
+  emit_directive("text");
+}
+
+void gen_x64(Node *node) {
+  gen_x64_header();
   gen(node);
 }